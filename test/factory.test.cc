@@ -25,12 +25,45 @@
 #include <benchmark/benchmark.h>
 #include <gtest/gtest.h>
 #include <boost/lexical_cast.hpp>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <future>
 #include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
 
+// The suite is built twice, with and without UNIQUE_FACTORY_STATISTICS,
+// see Makefile.am.
 #include <unique_factory.hpp>
 
 using unique_factory::UniqueFactory;
 
+namespace {
+
+// A key whose hash must never be computed.
+struct Unhashable {
+  int value;
+
+  bool operator==(const Unhashable& rhs) const { return value == rhs.value; }
+};
+
+}
+
+namespace std {
+
+template <>
+struct hash<Unhashable> {
+  size_t operator()(const Unhashable&) const { throw std::logic_error("Unhashable should not have been hashed"); }
+};
+
+}
+
 TEST(Factory, NonPointerKeyNonPointerValue) {
   // A factory int -> int
   using Key = int;
@@ -78,7 +111,7 @@ TEST(Factory, NonPointerKeyWeakValue) {
 
 TEST(Factory, SharedKeyNonPointerValue) {
   // A factory shared_ptr<int> -> int
-  using Key = shared_ptr<int>;
+  using Key = std::shared_ptr<int>;
   using Value = int;
   // Just like with a shared_ptr value, a shared_ptr key has no special
   // semantics different from a non-pointer.
@@ -96,7 +129,7 @@ TEST(Factory, SharedKeyNonPointerValue) {
 TEST(Factory, WeakKeyNonPointerValue) {
   // A factory weak_ptr<int> -> int that only keep the value alive as long as
   // the key is.
-  using Key = weak_ptr<int>;
+  using Key = std::weak_ptr<int>;
   using Value = int;
   UniqueFactory<Value, Key> factory;
   auto key = std::make_shared<int>(0);
@@ -114,8 +147,8 @@ TEST(Factory, WeakKeyNonPointerValue) {
 TEST(Factory, WeakKeyWeakValue) {
   // A factory weak_ptr<int> -> shared_ptr<int> that does not keep the value
   // alive and also only as long as the key is.
-  using Key = weak_ptr<int>;
-  using Value = weak_ptr<int>;
+  using Key = std::weak_ptr<int>;
+  using Value = std::weak_ptr<int>;
   UniqueFactory<Value, Key> factory;
   auto key = std::make_shared<int>(0);
   auto weak = Key(key);
@@ -139,7 +172,7 @@ TEST(Factory, WeakKeyWeakValue) {
 TEST(Factory, MixedKeyNonPointerValue) {
   // A factory (weak_ptr<int>, int) -> int
   using Value = int;
-  UniqueFactory<Value, weak_ptr<int>, int> factory;
+  UniqueFactory<Value, std::weak_ptr<int>, int> factory;
 
   auto key = std::make_shared<int>(0);
   auto weak = std::shared_ptr<int>(key);
@@ -156,4 +189,920 @@ TEST(Factory, MixedKeyNonPointerValue) {
   EXPECT_EQ(2, factory.get(weak, 2, []() { return 2; }));
 }
 
+// A key that is compared ignoring case; it has no std::hash.
+struct CaseInsensitive {
+  std::string name;
+};
+
+namespace {
+namespace unique_factory {
+template <>
+struct KeyComponent<CaseInsensitive> {
+  static std::string lower(const std::string& name) {
+    std::string ret = name;
+    for (char& c : ret)
+      c = char(std::tolower(static_cast<unsigned char>(c)));
+    return ret;
+  }
+  static std::size_t hash(const CaseInsensitive& key) { return std::hash<std::string>{}(lower(key.name)); }
+  static bool equal(const CaseInsensitive& lhs, const CaseInsensitive& rhs) { return lower(lhs.name) == lower(rhs.name); }
+  static bool expired(const CaseInsensitive&) { return false; }
+};
+}
+}
+
+TEST(Factory, CustomKeyComponent) {
+  // A factory (CaseInsensitive, int) -> int with a custom hash and equality.
+  UniqueFactory<int, CaseInsensitive, int> factory;
+  EXPECT_EQ(1, factory.get(CaseInsensitive{"Key"}, 0, []() { return 1; }));
+  EXPECT_EQ(1, factory.get(CaseInsensitive{"KEY"}, 0, []() { return 2; }));
+  EXPECT_EQ(std::nullopt, factory.find(CaseInsensitive{"KEY"}, 1));
+}
+
+// Key traits that compare integers by their last digit and all other keys
+// like KeyComponent does.
+template <typename K>
+struct LastDigit : unique_factory::KeyComponent<K> {};
+
+template <>
+struct LastDigit<int> {
+  static std::size_t hash(int key) { return std::size_t(key % 10); }
+  static bool equal(int lhs, int rhs) { return lhs % 10 == rhs % 10; }
+  static bool expired(int) { return false; }
+};
+
+TEST(Factory, CustomTraits) {
+  // A factory (int, string) -> int with its own hash and equality for the
+  // integers; other factories are not affected.
+  unique_factory::BasicUniqueFactory<unique_factory::NoObserver, LastDigit, int, int, std::string> factory;
+  EXPECT_EQ(1, factory.get(1, "a", []() { return 1; }));
+  EXPECT_EQ(1, factory.get(11, "a", []() { return 2; }));
+  EXPECT_EQ(std::nullopt, factory.find(11, "b"));
+
+  UniqueFactory<int, int, std::string> plain;
+  EXPECT_EQ(1, plain.get(1, "a", []() { return 1; }));
+  EXPECT_EQ(2, plain.get(11, "a", []() { return 2; }));
+}
+
+TEST(Factory, Find) {
+  // A factory int -> shared_ptr<int> that can be queried without creating
+  // anything.
+  UniqueFactory<std::weak_ptr<int>, int> factory;
+  EXPECT_EQ(nullptr, factory.find(0));
+
+  auto value = factory.get(0, []() { return new int(0); });
+  EXPECT_EQ(value, factory.find(0));
+
+  // Expired values are not found.
+  value.reset();
+  EXPECT_EQ(nullptr, factory.find(0));
+}
+
+TEST(Factory, TryGet) {
+  // try_get() does not wait for a construction in another thread.
+  UniqueFactory<std::weak_ptr<int>, int> factory;
+
+  std::promise<void> started, release;
+  std::shared_ptr<int> value;
+  std::thread creator([&]() {
+    value = factory.get(0, [&]() {
+      started.set_value();
+      release.get_future().wait();
+      return new int(0);
+    });
+  });
+
+  started.get_future().wait();
+  EXPECT_EQ(nullptr, factory.try_get(0));
+
+  release.set_value();
+  creator.join();
+  EXPECT_EQ(value, factory.try_get(0));
+  EXPECT_EQ(value, factory.find(0));
+}
+
+TEST(Factory, PrecomputedHash) {
+  // A factory whose keys must not be hashed when the hash is provided.
+  UniqueFactory<std::weak_ptr<int>, Unhashable> factory;
+
+  const std::size_t hash = 1337;
+  auto value = factory.get(Unhashable{0}, hash, []() { return new int(0); });
+  EXPECT_EQ(0, *value);
+  EXPECT_EQ(value, factory.get(Unhashable{0}, hash, []() { return new int(1); }));
+  EXPECT_EQ(value, factory.find(Unhashable{0}, hash));
+  EXPECT_EQ(nullptr, factory.find(Unhashable{1}, hash));
+}
+
+TEST(Factory, CompositeKey) {
+  // A factory (int, string, int) -> shared_ptr<int>
+  UniqueFactory<std::weak_ptr<int>, int, std::string, int> factory;
+
+  auto value = factory.get(0, "a", 1, []() { return new int(0); });
+  EXPECT_EQ(value, factory.get(0, "a", 1, []() { return new int(1); }));
+
+  // All parts of the key are taken into account.
+  EXPECT_EQ(nullptr, factory.find(0, "a", 2));
+  EXPECT_EQ(nullptr, factory.find(0, "b", 1));
+  EXPECT_EQ(nullptr, factory.find(1, "a", 1));
+
+  EXPECT_EQ(value, factory.find(0, "a", 1, decltype(factory)::hash(0, "a", 1)));
+}
+
+TEST(Factory, WeakKeyComponent) {
+  // A factory (weak_ptr<int>, int) -> shared_ptr<int>
+  UniqueFactory<std::weak_ptr<int>, std::weak_ptr<int>, int> factory;
+
+  auto key = std::make_shared<int>(0);
+  auto weak = std::weak_ptr<int>(key);
+  const auto hash = decltype(factory)::hash(weak, 0);
+
+  auto value = factory.get(weak, 0, []() { return new int(0); });
+  EXPECT_EQ(value, factory.get(key, 0, []() { return new int(1); }));
+
+  // Weak keys are compared by owner and not by the object they point to.
+  auto alias = std::shared_ptr<int>(key, key.get());
+  EXPECT_EQ(value, factory.find(alias, 0));
+
+  // The factory does not keep the key alive.
+  key.reset();
+  alias.reset();
+  EXPECT_TRUE(weak.expired());
+
+  // The entry died with its key even though the value is still alive.
+  EXPECT_EQ(nullptr, factory.find(weak, 0, hash));
+  EXPECT_EQ(0, *value);
+}
+
+// A key that dies with the object it refers to.
+struct Parent {
+  std::weak_ptr<int> ptr;
+};
+
+namespace {
+namespace unique_factory {
+template <>
+struct KeyComponent<Parent> {
+  static constexpr bool expires = true;
+  static std::size_t hash(const Parent& key) { return KeyComponent<std::weak_ptr<int>>::hash(key.ptr); }
+  static bool equal(const Parent& lhs, const Parent& rhs) { return KeyComponent<std::weak_ptr<int>>::equal(lhs.ptr, rhs.ptr); }
+  static bool expired(const Parent& key) { return key.ptr.expired(); }
+};
+}
+}
+
+TEST(Factory, ExpiringKeyComponent) {
+  // A factory Parent -> int whose entries go away with their parent.
+  UniqueFactory<int, Parent> factory;
+
+  for (int i = 0; i < 10000; i++) {
+    auto parent = std::make_shared<int>(i);
+    EXPECT_EQ(i, factory.get(Parent{parent}, [&]() { return i; }));
+  }
+
+  factory.on_memory_pressure(unique_factory::MemoryPressure::CRITICAL);
+  EXPECT_EQ(0, factory.memory_usage().nodes);
+}
+
+TEST(Factory, MemoFind) {
+  // A factory int -> int reports missing values as an empty optional.
+  UniqueFactory<int, int> factory;
+  EXPECT_EQ(std::nullopt, factory.find(0));
+  EXPECT_EQ(1, factory.get(0, []() { return 1; }));
+  EXPECT_EQ(1, factory.find(0));
+  EXPECT_EQ(1, factory.try_get(0));
+}
+
+// A value that cannot be copied while copies are disabled.
+struct Fragile {
+  static bool copyable;
+
+  int value;
+
+  explicit Fragile(int value) : value(value) {}
+  Fragile(const Fragile& rhs) : value(rhs.value) {
+    if (!copyable)
+      throw std::bad_alloc();
+  }
+  Fragile(Fragile&&) = default;
+};
+
+bool Fragile::copyable = true;
+
+TEST(Factory, MemoThrowingCopy) {
+  // A factory int -> Fragile whose values fail to copy; the entry must not
+  // be left in construction.
+  UniqueFactory<Fragile, int> factory;
+
+  Fragile::copyable = false;
+  EXPECT_THROW(factory.get(0, []() { return Fragile(0); }), std::bad_alloc);
+  Fragile::copyable = true;
+
+  EXPECT_EQ(0, factory.get(0, []() { return Fragile(1); }).value);
+  EXPECT_EQ(0, std::async(std::launch::async, [&]() { return factory.find(0)->value; }).get());
+}
+
+TEST(Factory, WeakValueCreate) {
+  // A factory int -> shared_ptr<int> accepts any kind of owner from create().
+  UniqueFactory<std::weak_ptr<int>, int> factory;
+
+  auto raw = factory.get(0, []() { return new int(0); });
+  auto unique = factory.get(1, []() { return std::make_unique<int>(1); });
+  auto shared = factory.get(2, []() { return std::make_shared<int>(2); });
+  auto value = factory.get(3, []() { return 3; });
+
+  EXPECT_EQ(0, *raw);
+  EXPECT_EQ(1, *unique);
+  EXPECT_EQ(2, *shared);
+  EXPECT_EQ(3, *value);
+
+  EXPECT_EQ(shared, factory.find(2));
+}
+
+TEST(Factory, Prewarm) {
+  // A factory (int, int) -> shared_ptr<int> that is filled in parallel.
+  UniqueFactory<std::weak_ptr<int>, int, int> factory;
+
+  std::vector<std::tuple<int, int>> keys;
+  for (int i = 0; i < 64; i++)
+    keys.emplace_back(i, -i);
+
+  std::vector<std::thread> workers;
+  auto values = factory.prewarm(keys, [](int a, int b) { return new int(a - b); }, [&](std::function<void()> task) {
+    workers.emplace_back(task);
+  });
+
+  for (auto& worker : workers)
+    worker.join();
+
+  ASSERT_EQ(keys.size(), values.size());
+  for (int i = 0; i < 64; i++) {
+    EXPECT_EQ(2 * i, *values[i]);
+    // The values are kept alive by the returned vector.
+    EXPECT_EQ(values[i], factory.get(i, -i, []() { return new int(-1); }));
+  }
+}
+
+TEST(Factory, Retain) {
+  // A factory int -> shared_ptr<int> that keeps the two most recently
+  // released values alive.
+  UniqueFactory<std::weak_ptr<int>, int> factory;
+  factory.retain(2);
+
+  int created = 0;
+  auto create = [&](int value) {
+    return [&created, value]() {
+      created++;
+      return new int(value);
+    };
+  };
+
+  factory.get(0, create(0));
+  factory.get(1, create(1));
+  EXPECT_EQ(2, created);
+
+  // Released values come back without being recreated.
+  EXPECT_EQ(0, *factory.get(0, create(0)));
+  EXPECT_EQ(2, created);
+
+  // The least recently used value is dropped first.
+  factory.get(2, create(2));
+  EXPECT_EQ(3, created);
+  EXPECT_EQ(nullptr, factory.find(1));
+  EXPECT_EQ(0, *factory.find(0));
+  EXPECT_EQ(2, *factory.try_get(2));
+
+  // Values that are still in use are not affected by retention.
+  auto value = factory.get(3, create(3));
+  factory.retain(0);
+  EXPECT_EQ(nullptr, factory.find(0));
+  EXPECT_EQ(value, factory.find(3));
+  EXPECT_EQ(4, created);
+}
+
+TEST(Factory, RetainClock) {
+  // A factory int -> shared_ptr<int> that keeps two released values alive
+  // and gives values that have been used recently a second chance.
+  UniqueFactory<std::weak_ptr<int>, int> factory;
+  factory.retain(2, unique_factory::RetentionPolicy::CLOCK);
+
+  auto value = factory.get(0, []() { return new int(0); });
+  // This lookup marks the value as used.
+  EXPECT_EQ(value, factory.get(0, []() { return new int(-1); }));
+  value.reset();
+
+  factory.get(1, []() { return new int(1); });
+  factory.get(2, []() { return new int(2); });
+
+  // With LRU, 0 would have been dropped; CLOCK drops 1 instead.
+  EXPECT_EQ(nullptr, factory.find(1));
+  EXPECT_EQ(0, *factory.find(0));
+  EXPECT_EQ(2, *factory.find(2));
+}
+
+TEST(Factory, RetainClockHoldsValues) {
+  // With CLOCK, the factory holds on to the values it hands out, so handing
+  // them out again only needs to mark them as used.
+  UniqueFactory<std::weak_ptr<int>, int> factory;
+  factory.retain(1, unique_factory::RetentionPolicy::CLOCK);
+
+  auto value = factory.get(0, []() { return new int(0); });
+  EXPECT_EQ(2, value.use_count());
+  const int* object = value.get();
+  value.reset();
+  EXPECT_EQ(object, factory.find(0).get());
+
+  // 0 has been used, so 1 is not kept.
+  auto other = factory.get(1, []() { return new int(1); });
+  EXPECT_EQ(1, other.use_count());
+
+  // The previous round used up the second chance of 0.
+  factory.get(2, []() { return new int(2); });
+  EXPECT_EQ(nullptr, factory.find(0));
+  EXPECT_EQ(2, *factory.find(2));
+}
+
+TEST(Factory, RetainGreedyDual) {
+  // A factory int -> shared_ptr<int> that keeps two released values alive
+  // and prefers to keep values that are expensive to create.
+  UniqueFactory<std::weak_ptr<int>, int> factory;
+  factory.retain(2, unique_factory::RetentionPolicy::GREEDY_DUAL);
+
+  factory.get(0, []() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    return new int(0);
+  });
+  factory.get(1, []() { return new int(1); });
+  factory.get(2, []() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    return new int(2);
+  });
+
+  // With LRU, 0 would have been dropped; it is however the most expensive
+  // value so the cheapest one is dropped instead.
+  EXPECT_EQ(0, *factory.find(0));
+  EXPECT_EQ(nullptr, factory.find(1));
+  EXPECT_EQ(2, *factory.find(2));
+}
+
+TEST(Factory, RetainFor) {
+  // A factory int -> shared_ptr<int> that keeps released values alive for a
+  // while.
+  UniqueFactory<std::weak_ptr<int>, int> factory;
+  const auto ttl = std::chrono::milliseconds(50);
+  factory.retain_for(ttl);
+
+  // The value is retained unless we were too slow to look for it.
+  const auto start = std::chrono::steady_clock::now();
+  factory.get(0, []() { return new int(0); });
+  auto retained = factory.find(0);
+  if (std::chrono::steady_clock::now() - start < ttl) {
+    EXPECT_NE(nullptr, retained);
+  }
+  if (retained != nullptr) {
+    EXPECT_EQ(0, *retained);
+  }
+  retained.reset();
+
+  std::this_thread::sleep_for(ttl * 2);
+  EXPECT_EQ(nullptr, factory.find(0));
+  EXPECT_EQ(1, *factory.get(0, []() { return new int(1); }));
+}
+
+// A value that reports when it is destroyed.
+struct Tracked {
+  std::atomic<bool>* destroyed;
+
+  ~Tracked() { *destroyed = true; }
+};
+
+TEST(Factory, RetainForExpires) {
+  // A factory int -> shared_ptr<Tracked> whose released values expire even
+  // if nothing else happens in the factory.
+  UniqueFactory<std::weak_ptr<Tracked>, int> factory;
+  factory.retain_for(std::chrono::milliseconds(10));
+
+  std::atomic<bool> destroyed{false};
+  factory.get(0, [&]() { return new Tracked{&destroyed}; });
+  EXPECT_FALSE(destroyed);
+
+  for (int i = 0; i < 1000 && !destroyed; i++)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  EXPECT_TRUE(destroyed);
+
+  // Disabling the time to live stops the thread.
+  factory.retain_for(std::chrono::steady_clock::duration::zero());
+}
+
+TEST(Factory, RetainForRetained) {
+  // Setting a time to live does not drop values that were retained just
+  // now.
+  UniqueFactory<std::weak_ptr<int>, int> factory;
+  factory.retain(4);
+  factory.get(0, []() { return new int(0); });
+
+  factory.retain_for(std::chrono::minutes(10));
+  EXPECT_NE(nullptr, factory.try_get(0));
+}
+
+TEST(Factory, RetainBytes) {
+  // A factory int -> shared_ptr<std::string> that keeps released values
+  // alive as long as they take up at most 10 bytes in total.
+  UniqueFactory<std::weak_ptr<std::string>, int> factory;
+  factory.retain_bytes(10, [](const std::string& value) { return value.size(); });
+
+  factory.get(0, []() { return std::string(4, '0'); });
+  factory.get(1, []() { return std::string(4, '1'); });
+  EXPECT_EQ("0000", *factory.find(0));
+  EXPECT_EQ("1111", *factory.find(1));
+
+  // Retaining this value exceeds the budget so the least recently used
+  // value is dropped.
+  factory.get(2, []() { return std::string(4, '2'); });
+  EXPECT_EQ(nullptr, factory.find(0));
+  EXPECT_EQ("1111", *factory.find(1));
+  EXPECT_EQ("2222", *factory.find(2));
+
+  // Values that exceed the budget on their own are not retained at all.
+  factory.get(3, []() { return std::string(11, '3'); });
+  EXPECT_EQ(nullptr, factory.find(3));
+  EXPECT_EQ("1111", *factory.find(1));
+}
+
+TEST(Factory, SweepEvery) {
+  // A factory weak_ptr<int> -> shared_ptr<int> that stores its values.
+  UniqueFactory<std::shared_ptr<int>, std::weak_ptr<int>> factory;
+
+  auto key = std::make_shared<int>(0);
+  auto value = factory.get(key, []() { return std::make_shared<int>(0); });
+  EXPECT_EQ(2, value.use_count());
+
+  // The entry dies with its key but is only dropped by the sweeper.
+  key.reset();
+  EXPECT_EQ(2, value.use_count());
+
+  factory.sweep_every(std::chrono::milliseconds(1));
+  for (int i = 0; i < 1000 && value.use_count() != 1; i++)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  EXPECT_EQ(1, value.use_count());
+}
+
+TEST(Factory, Pin) {
+  // A factory int -> shared_ptr<int> that keeps a value alive.
+  UniqueFactory<std::weak_ptr<int>, int> factory;
+
+  int created = 0;
+  EXPECT_EQ(0, *factory.pin(0, [&]() { created++; return new int(0); }));
+  EXPECT_EQ(1, created);
+
+  // The pinned value is not released.
+  EXPECT_EQ(0, *factory.find(0));
+  EXPECT_EQ(factory.find(0).get(), factory.pinned(0));
+  EXPECT_EQ(nullptr, factory.pinned(1));
+
+  EXPECT_TRUE(factory.unpin(0));
+  EXPECT_FALSE(factory.unpin(0));
+  EXPECT_EQ(nullptr, factory.find(0));
+  EXPECT_EQ(nullptr, factory.pinned(0));
+
+  // Pinned values are released with the factory.
+  factory.pin(1, []() { return new int(1); });
+}
+
+TEST(Factory, PinExpiringKey) {
+  // A factory weak_ptr<int> -> shared_ptr<Tracked> whose pins go away with
+  // their key.
+  UniqueFactory<std::weak_ptr<Tracked>, std::weak_ptr<int>> factory;
+
+  auto key = std::make_shared<int>(0);
+  std::weak_ptr<int> weak = key;
+  std::atomic<bool> destroyed{false};
+  factory.pin(key, [&]() { return new Tracked{&destroyed}; });
+  EXPECT_NE(nullptr, factory.pinned(key));
+
+  key.reset();
+  EXPECT_EQ(nullptr, factory.pinned(weak));
+
+  // The pin is released once the factory comes across the entry.
+  factory.on_memory_pressure(unique_factory::MemoryPressure::CRITICAL);
+  EXPECT_TRUE(destroyed);
+}
+
+TEST(Factory, AdmitTinyLFU) {
+  // A factory int -> shared_ptr<int> that keeps two released values alive
+  // but only if they are asked for often.
+  UniqueFactory<std::weak_ptr<int>, int> factory;
+  factory.retain(2);
+  factory.admit(unique_factory::AdmissionPolicy::TINY_LFU);
+
+  for (int i = 0; i < 8; i++) {
+    factory.get(0, []() { return new int(0); });
+    factory.get(1, []() { return new int(1); });
+  }
+
+  // A scan over keys that are only used once does not flush the values
+  // that are used all the time.
+  for (int i = 100; i < 200; i++)
+    factory.get(i, [&]() { return new int(i); });
+
+  EXPECT_EQ(0, *factory.find(0));
+  EXPECT_EQ(1, *factory.find(1));
+  EXPECT_EQ(nullptr, factory.find(199));
+}
+
+TEST(Factory, MemoryPressure) {
+  // A factory int -> shared_ptr<int> that keeps released values alive
+  // unless memory is scarce.
+  UniqueFactory<std::weak_ptr<int>, int> factory;
+  factory.retain(4);
+
+  factory.pin(4, []() { return new int(4); });
+  for (int i = 0; i < 4; i++)
+    factory.get(i, [&]() { return new int(i); });
+
+  // Half of the retained values are dropped, the least recently used first.
+  factory.on_memory_pressure(unique_factory::MemoryPressure::MODERATE);
+  EXPECT_EQ(nullptr, factory.try_get(0));
+  EXPECT_EQ(nullptr, factory.try_get(1));
+  EXPECT_EQ(2, *factory.try_get(2));
+  EXPECT_EQ(3, *factory.try_get(3));
+
+  // A monitor drops all retained values when memory is critical; pinned
+  // values stay.
+  const std::string path = testing::TempDir() + "memory.pressure";
+  std::FILE* file = std::fopen(path.c_str(), "w");
+  ASSERT_NE(nullptr, file);
+  std::fputs("some avg10=60.00 avg60=10.00 avg300=2.00 total=1000\nfull avg10=40.00 avg60=5.00 avg300=1.00 total=500\n", file);
+  std::fclose(file);
+
+  factory.monitor_memory_pressure(std::chrono::milliseconds(1), path);
+  for (int i = 0; i < 1000 && factory.try_get(3) != nullptr; i++)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  factory.monitor_memory_pressure(std::chrono::milliseconds(0));
+  std::remove(path.c_str());
+
+  EXPECT_EQ(nullptr, factory.try_get(2));
+  EXPECT_EQ(nullptr, factory.try_get(3));
+  EXPECT_EQ(4, *factory.try_get(4));
+
+  factory.unpin(4);
+}
+
+#ifdef UNIQUE_FACTORY_STATISTICS
+TEST(Factory, Statistics) {
+  // A factory int -> shared_ptr<int> that counts what it does.
+  UniqueFactory<std::weak_ptr<int>, int> factory;
+
+  auto value = factory.get(0, []() { return new int(0); });
+  EXPECT_EQ(value, factory.get(0, []() { return new int(1); }));
+  EXPECT_EQ(value, factory.find(0));
+  EXPECT_EQ(nullptr, factory.try_get(1));
+
+  auto statistics = factory.statistics();
+  EXPECT_EQ(2, statistics.hits);
+  EXPECT_EQ(2, statistics.misses);
+  EXPECT_EQ(1, statistics.size);
+  EXPECT_EQ(1, statistics.peak);
+  EXPECT_EQ(1, statistics.rehashes);
+  EXPECT_EQ(0, statistics.erasures);
+
+  // Values that are not retained are dropped right away.
+  value.reset();
+  for (int i = 0; i < 16; i++)
+    factory.get(i, [&]() { return new int(i); });
+
+  statistics = factory.statistics();
+  EXPECT_EQ(17, statistics.erasures);
+  EXPECT_EQ(0, statistics.size);
+  EXPECT_EQ(1, statistics.peak);
+}
+
+TEST(Factory, CreationHistogram) {
+  // A factory int -> int that records how long it takes to create values.
+  UniqueFactory<int, int> factory;
+
+  for (int i = 0; i < 10; i++)
+    factory.get(i, [&]() {
+      if (i == 9)
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      return i;
+    });
+
+  const auto creation = factory.statistics().creation;
+  EXPECT_EQ(10, creation.count());
+  EXPECT_LT(creation.percentile(.5), std::chrono::milliseconds(20));
+  EXPECT_GE(creation.percentile(1), std::chrono::milliseconds(20));
+
+  // The buckets are log-linear.
+  using unique_factory::Histogram;
+  for (std::uint64_t nanoseconds : {0ull, 7ull, 8ull, 15ull, 16ull, 1000ull, 123456789ull, ~0ull}) {
+    const auto bucket = Histogram::bucket(nanoseconds);
+    EXPECT_LE(Histogram::lower(bucket), nanoseconds);
+    if (bucket + 1 < Histogram::size) {
+      EXPECT_GT(Histogram::lower(bucket + 1), nanoseconds);
+    }
+  }
+}
+
+TEST(Factory, LockContention) {
+  // Let a thread wait for the lock while another holds it for delay and
+  // return what the factory measured.
+  const auto contend = [](std::chrono::milliseconds delay) {
+    // A factory int -> shared_ptr<int> whose size_of holds the lock of the
+    // factory until we let it go.
+    UniqueFactory<std::weak_ptr<int>, int> factory;
+
+    std::promise<void> measuring;
+    std::promise<void> measured;
+    auto finish = measured.get_future().share();
+    factory.retain_bytes(1024, [&, first = true](const int&) mutable {
+      if (first) {
+        first = false;
+        measuring.set_value();
+        finish.wait();
+      }
+      return std::size_t(1);
+    });
+
+    EXPECT_EQ(0, factory.statistics().contentions);
+
+    // Releasing the value calls size_of with the factory locked.
+    auto releaser = std::async(std::launch::async, [&]() { factory.get(0, []() { return new int(0); }); });
+    measuring.get_future().wait();
+
+    std::promise<void> waiting;
+    auto waiter = std::async(std::launch::async, [&]() {
+      waiting.set_value();
+      return factory.try_get(0);
+    });
+    waiting.get_future().wait();
+    std::this_thread::sleep_for(delay);
+    measured.set_value();
+
+    releaser.get();
+    EXPECT_EQ(0, *waiter.get());
+
+    return factory.statistics();
+  };
+
+  // We cannot tell when the waiter blocks on the lock. Should it not have
+  // gotten there before the lock was released, we try again and hold the
+  // lock longer.
+  auto statistics = contend(std::chrono::milliseconds(1));
+  for (int round = 1; round < 12 && statistics.contentions == 0; round++)
+    statistics = contend(std::chrono::milliseconds(1 << round));
+
+  EXPECT_GE(statistics.contentions, 1);
+  EXPECT_GT(statistics.longest_wait, std::chrono::nanoseconds(0));
+  EXPECT_GE(statistics.wait, statistics.longest_wait);
+}
+#endif
+
+// An observer that logs all the events of a factory; its callbacks might
+// be invoked from several threads at once.
+struct Log : unique_factory::NoObserver {
+  std::vector<std::string>* events;
+  std::shared_ptr<std::mutex> mutex = std::make_shared<std::mutex>();
+
+  void on_hit(int key) { log("hit " + std::to_string(key)); }
+  void on_miss(int key) { log("miss " + std::to_string(key)); }
+  void on_created(const std::shared_ptr<int>& value, int key) { log("created " + std::to_string(key) + " = " + std::to_string(*value)); }
+  void on_released(int key) { log("released " + std::to_string(key)); }
+  void on_erased(int key) { log("erased " + std::to_string(key)); }
+
+  void log(std::string event) {
+    std::lock_guard<std::mutex> lock(*mutex);
+    events->push_back(std::move(event));
+  }
+};
+
+TEST(Factory, Observer) {
+  // A factory int -> shared_ptr<int> that reports what it does.
+  std::vector<std::string> events;
+  unique_factory::BasicUniqueFactory<Log, unique_factory::KeyComponent, std::weak_ptr<int>, int> factory(Log{{}, &events});
+
+  {
+    auto value = factory.get(0, []() { return new int(1); });
+    factory.get(0, []() { return new int(2); });
+  }
+  factory.find(1);
+
+  EXPECT_EQ((std::vector<std::string>{"miss 0", "created 0 = 1", "hit 0", "released 0", "erased 0", "miss 1"}), events);
+}
+
+TEST(Factory, MemoryUsage) {
+  // A factory string -> shared_ptr<int> that keeps a released value alive.
+  UniqueFactory<std::weak_ptr<int>, std::string> factory;
+  factory.retain(1);
+
+  const auto empty = factory.memory_usage();
+  EXPECT_EQ(0, empty.buckets);
+  EXPECT_EQ(0, empty.nodes);
+  EXPECT_EQ(empty.bookkeeping, empty.total());
+
+  auto value = factory.get("alive", []() { return new int(0); });
+  factory.get("retained", []() { return new int(1); });
+
+  const auto usage = factory.memory_usage([](const std::string& key) { return key.capacity(); });
+  EXPECT_LT(0, usage.buckets);
+  EXPECT_LT(0, usage.nodes);
+  EXPECT_LE(std::string("alive").capacity() + std::string("retained").capacity(), usage.keys);
+  EXPECT_LT(0, usage.control_blocks);
+  EXPECT_EQ(sizeof(int), usage.retained);
+  EXPECT_EQ(0, factory.memory_usage().keys);
+}
+
+TEST(Factory, ForEachLive) {
+  // A factory int -> shared_ptr<int> whose live values we visit.
+  UniqueFactory<std::weak_ptr<int>, int> factory;
+
+  std::vector<std::shared_ptr<int>> alive;
+  for (int i = 0; i < 200; i++) {
+    auto value = factory.get(i, [&]() { return new int(i); });
+    if (i % 2 == 0)
+      alive.push_back(value);
+  }
+
+  // Each live value is visited once even if the callback grows the table.
+  std::vector<int> visits(200);
+  factory.for_each_live([&](int key, const std::shared_ptr<int>& value) {
+    EXPECT_EQ(key, *value);
+    EXPECT_EQ(value, factory.find(key));
+    if (key < 200)
+      visits[key]++;
+    alive.push_back(factory.get(1000 + key, [&]() { return new int(1000 + key); }));
+  });
+
+  for (int i = 0; i < 200; i++)
+    EXPECT_EQ(i % 2 == 0 ? 1 : 0, visits[i]);
+
+  alive.resize(100);
+  EXPECT_EQ(100, factory.snapshot().size());
+}
+
+TEST(Factory, Teardown) {
+  static std::vector<unique_factory::TeardownReport> reports;
+  const auto report = [](const unique_factory::TeardownReport& report) { reports.push_back(report); };
+
+  {
+    // A factory int -> shared_ptr<int> that is destroyed with a retained
+    // value which is not a leak.
+    UniqueFactory<std::weak_ptr<int>, int> factory;
+    factory.on_teardown(report);
+    factory.retain(1);
+    factory.get(0, []() { return new int(0); });
+  }
+
+  ASSERT_EQ(1, reports.size());
+  EXPECT_EQ(0, reports[0].leaked);
+  EXPECT_EQ(0, reports[0].bytes);
+
+  {
+    // A factory that does not tear anything down does not report either.
+    UniqueFactory<std::weak_ptr<int>, int> factory;
+    factory.on_teardown(report);
+    factory.skip_teardown();
+  }
+
+  EXPECT_EQ(1, reports.size());
+}
+
+TEST(Factory, TeardownRetainedChain) {
+  // A factory shared_ptr<int> -> shared_ptr<int> whose keys are values of
+  // the same factory. Each chain ends in a retained value that keeps all the
+  // other values of its chain alive through their keys.
+  UniqueFactory<std::weak_ptr<int>, std::shared_ptr<int>> factory;
+  factory.retain(100);
+
+  for (int chain = 0; chain < 100; chain++) {
+    auto previous = std::make_shared<int>(-chain);
+    for (int i = 0; i < 10; i++)
+      previous = factory.get(previous, [&]() { return new int(i); });
+  }
+}
+
+TEST(Factory, Registry) {
+  // Two factories that show up in the registry of this process.
+  UniqueFactory<std::weak_ptr<int>, int> weak;
+  UniqueFactory<int, int> memo;
+  weak.register_as("weak");
+  memo.register_as("memo \"table\"");
+
+  auto value = weak.get(0, []() { return new int(0); });
+  weak.get(0, []() { return new int(1); });
+  memo.get(0, []() { return 0; });
+  memo.get(1, []() { return 1; });
+
+  auto factories = libuniquefactory::factories();
+  ASSERT_EQ(2, factories.size());
+  EXPECT_EQ("weak", factories[0].name);
+  EXPECT_EQ(1, factories[0].size);
+#ifdef UNIQUE_FACTORY_STATISTICS
+  EXPECT_TRUE(factories[0].statistics);
+  EXPECT_EQ(1, factories[0].hits);
+  EXPECT_EQ(1, factories[0].misses);
+  EXPECT_EQ(.5, factories[0].hit_rate());
+#else
+  EXPECT_FALSE(factories[0].statistics);
+#endif
+  EXPECT_EQ(2, factories[1].size);
+  EXPECT_LT(0, factories[1].bytes);
+
+  const std::string json = libuniquefactory::to_json();
+  EXPECT_EQ(0, json.find("[{\"name\":\"weak\",\"size\":1,"));
+  EXPECT_NE(std::string::npos, json.find("{\"name\":\"memo \\\"table\\\"\",\"size\":2,"));
+#ifdef UNIQUE_FACTORY_STATISTICS
+  EXPECT_NE(std::string::npos, json.find(",\"hits\":1,\"misses\":1,\"hit_rate\":0.5}"));
+  EXPECT_NE(std::string::npos, json.find(",\"hits\":0,\"misses\":2,\"hit_rate\":0}"));
+#endif
+
+  {
+    UniqueFactory<int, int> temporary;
+    temporary.register_as("temporary");
+    EXPECT_EQ(3, libuniquefactory::factories().size());
+  }
+  EXPECT_EQ(2, libuniquefactory::factories().size());
+}
+
+TEST(Factory, HotKeys) {
+  // A factory int -> shared_ptr<int> that tracks its four hottest keys.
+  UniqueFactory<std::weak_ptr<int>, int> factory;
+  factory.track_hot_keys(4);
+
+  for (int i = 100; i < 200; i++)
+    factory.get(i, [&]() { return new int(i); });
+
+  // Key 3 is released and created again and again.
+  for (int i = 0; i < 3; i++)
+    factory.get(3, []() { return new int(3); });
+
+  // Key 7 is requested all the time.
+  auto value = factory.get(7, []() { return new int(7); });
+  for (int i = 0; i < 50; i++)
+    factory.get(7, []() { return new int(-1); });
+
+  const auto hot = factory.hot_keys();
+  ASSERT_LE(1, hot.size());
+  EXPECT_EQ(std::make_tuple(7), hot[0].key);
+  EXPECT_LE(51, hot[0].count);
+
+  const auto rebuilt = factory.rebuilt_keys();
+  ASSERT_EQ(1, rebuilt.size());
+  EXPECT_EQ(std::make_tuple(3), rebuilt[0].key);
+  EXPECT_EQ(3, rebuilt[0].count - rebuilt[0].error);
+
+  factory.track_hot_keys(0);
+  EXPECT_TRUE(factory.hot_keys().empty());
+}
+
+TEST(Factory, HotKeysOfThisFactory) {
+  // A factory shared_ptr<int> -> shared_ptr<int> whose keys are values of
+  // the same factory; tracking a key does not keep it alive.
+  UniqueFactory<std::weak_ptr<int>, std::shared_ptr<int>> factory;
+  factory.track_hot_keys(1);
+
+  auto key = factory.get(nullptr, []() { return new int(0); });
+  factory.get(key, []() { return new int(1); });
+
+  std::weak_ptr<int> tracked = key;
+  key.reset();
+  EXPECT_TRUE(tracked.expired());
+
+  // The tracked key is replaced, which must not release a value while the
+  // factory is locked.
+  factory.get(nullptr, []() { return new int(2); });
+
+  const auto hot = factory.hot_keys();
+  ASSERT_EQ(1, hot.size());
+  EXPECT_EQ(nullptr, std::get<0>(hot[0].key).lock());
+  EXPECT_EQ(3, hot[0].count);
+}
+
+TEST(Factory, PrewarmExecutorFailure) {
+  // A factory int -> int whose executor fails on the last submission, after
+  // the other tasks are already running.
+  UniqueFactory<int, int> factory;
+
+  const std::size_t tasks = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<std::thread> threads;
+  const auto executor = [&](std::function<void()> task) {
+    if (threads.size() + 1 == tasks)
+      throw std::runtime_error("executor is full");
+    threads.emplace_back(std::move(task));
+  };
+
+  std::vector<int> keys(64);
+  for (int i = 0; i < 64; i++)
+    keys[i] = i;
+
+  // The tasks that were submitted are done once prewarm() rethrows.
+  const auto create = [](int key) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    return key;
+  };
+  EXPECT_THROW(factory.prewarm(keys, create, executor), std::runtime_error);
+
+  for (auto& thread : threads)
+    thread.join();
+}
+
 #include "main.hpp"
@@ -25,72 +25,2383 @@
 #ifndef LIBUNIQUEFACTORY_UNIQUE_FACTORY_HPP
 #define LIBUNIQUEFACTORY_UNIQUE_FACTORY_HPP
 
-#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
 #include <functional>
+#include <iterator>
+#include <limits>
 #include <memory>
 #include <mutex>
-#include <unordered_map>
+#include <optional>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// With UNIQUE_FACTORY_USDT defined, factories have static tracepoints
+// (USDT) that tools such as bpftrace or perf can attach to; they cost a
+// no-op instruction when nothing is attached. All probes of the provider
+// unique_factory take the address of the factory and the hash of the key:
+// hit, miss, create__start, create__end, and release.
+#ifdef UNIQUE_FACTORY_USDT
+#include <sys/sdt.h>
+#define LIBUNIQUEFACTORY_PROBE(name, factory, hash) DTRACE_PROBE2(unique_factory, name, factory, hash)
+#else
+#define LIBUNIQUEFACTORY_PROBE(name, factory, hash) do { (void)(factory); (void)(hash); } while (false)
+#endif
+
+// The registry is shared by all translation units of a process, so unlike
+// the factories themselves it cannot live in an anonymous namespace.
+namespace libuniquefactory {
+
+// What the registry reports about a factory, see factories().
+struct FactoryInfo {
+  std::string name;
+  // The number of entries in the table.
+  std::size_t size = 0;
+  // The memory used by the factory, see UniqueFactory::memory_usage().
+  std::size_t bytes = 0;
+  // Hits and misses are only counted if the factory was compiled with
+  // UNIQUE_FACTORY_STATISTICS.
+  bool statistics = false;
+  std::uint64_t hits = 0;
+  std::uint64_t misses = 0;
+
+  double hit_rate() const { return hits + misses == 0 ? 0 : double(hits) / double(hits + misses); }
+};
+
+// The factories that registered with UniqueFactory::register_as().
+class Registry {
+ public:
+  using Describe = FactoryInfo (*)(void* factory);
+
+  void add(void* factory, std::string name, Describe describe) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto& entry : entries) {
+      if (entry.factory == factory) {
+        entry.name = std::move(name);
+        return;
+      }
+    }
+    entries.push_back({factory, std::move(name), describe});
+  }
+
+  void remove(void* factory) {
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.erase(std::remove_if(entries.begin(), entries.end(), [&](const Entry& entry) { return entry.factory == factory; }), entries.end());
+  }
+
+  // Return the current state of all registered factories. The factories
+  // are locked one after the other while they are being described.
+  std::vector<FactoryInfo> factories() {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    std::vector<FactoryInfo> ret;
+    ret.reserve(entries.size());
+    for (const auto& entry : entries) {
+      ret.push_back(entry.describe(entry.factory));
+      ret.back().name = entry.name;
+    }
+    return ret;
+  }
+
+ private:
+  struct Entry {
+    void* factory;
+    std::string name;
+    Describe describe;
+  };
+
+  std::mutex mutex;
+  std::vector<Entry> entries;
+};
+
+// Return the registry of this process. It is never destroyed so that
+// factories with static storage duration can unregister at any time.
+inline Registry& registry() {
+  static Registry* registry = new Registry();
+  return *registry;
+}
+
+inline std::vector<FactoryInfo> factories() { return registry().factories(); }
+
+// Return the registered factories as a JSON array of objects.
+inline std::string to_json() {
+  const auto quote = [](const std::string& text) {
+    std::string ret = "\"";
+    for (const char c : text) {
+      if (c == '"' || c == '\\') {
+        ret += '\\';
+        ret += c;
+      } else if (static_cast<unsigned char>(c) < 0x20) {
+        char escaped[8];
+        std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+        ret += escaped;
+      } else {
+        ret += c;
+      }
+    }
+    return ret + "\"";
+  };
+
+  std::string ret = "[";
+  for (const auto& info : factories()) {
+    if (ret.size() != 1)
+      ret += ",";
+    ret += "{\"name\":" + quote(info.name) + ",\"size\":" + std::to_string(info.size) + ",\"bytes\":" + std::to_string(info.bytes);
+    if (info.statistics) {
+      // We do not use printf() for the rate since it would write a decimal
+      // comma in some locales.
+      const std::uint64_t millionths = std::uint64_t(info.hit_rate() * 1e6 + .5);
+      std::string rate = std::to_string(millionths / 1000000);
+      if (millionths % 1000000 != 0) {
+        std::string fraction = std::to_string(1000000 + millionths % 1000000).substr(1);
+        fraction.erase(fraction.find_last_not_of('0') + 1);
+        rate += "." + fraction;
+      }
+      ret += ",\"hits\":" + std::to_string(info.hits) + ",\"misses\":" + std::to_string(info.misses) + ",\"hit_rate\":" + rate;
+    }
+    ret += "}";
+  }
+  return ret + "]";
+}
+
+}
 
 namespace {
 
 namespace unique_factory {
 
-template <typename Key, typename Value, typename Hash = std::hash<Key>, typename KeyEqual = std::equal_to<Key>>
-class UniqueFactory {
-  std::mutex mutex;
+template <typename Value>
+struct is_weak_ptr : std::false_type {};
+
+template <typename T>
+struct is_weak_ptr<std::weak_ptr<T>> : std::true_type {};
+
+// How a component of a key is hashed and compared by default. This replaces
+// the Hash and KeyEqual parameters that the factory used to take: to use a
+// key type that has no std::hash or that should be compared differently,
+// specialize this template after including this header, e.g.,
+//
+//   namespace { namespace unique_factory {
+//   template <>
+//   struct KeyComponent<MyKey> {
+//     static std::size_t hash(const MyKey& key) { return MyHash{}(key); }
+//     static bool equal(const MyKey& lhs, const MyKey& rhs) { return MyEqual{}(lhs, rhs); }
+//     // Whether keys of this type can expire at all; if not, expired() is
+//     // never called.
+//     static constexpr bool expires = false;
+//     // Whether the entry for this key can never be looked up again.
+//     static bool expired(const MyKey&) { return false; }
+//   };
+//   } }
+//
+// Like the factory itself, this template lives in an anonymous namespace,
+// so the specialization must be visible in every translation unit that
+// uses a factory with such keys. It applies to each component of a
+// composite key separately. A specialization that does not declare
+// expires is treated as one whose keys never expire.
+//
+// A factory that should hash and compare its keys differently than all
+// others can instead be given its own template with the same members as
+// the Traits parameter of BasicUniqueFactory; that template does not need
+// to live in this namespace.
+template <typename K>
+struct KeyComponent {
+  static constexpr bool expires = false;
+  static std::size_t hash(const K& key) { return std::hash<K>{}(key); }
+  static bool equal(const K& lhs, const K& rhs) { return std::equal_to<K>{}(lhs, rhs); }
+  static bool expired(const K&) { return false; }
+};
+
+// Whether the entries for keys with this component can expire, i.e., the
+// expires of its Traits, see KeyComponent above.
+template <template <typename> class Traits, typename K, typename = void>
+struct expires : std::false_type {};
+
+template <template <typename> class Traits, typename K>
+struct expires<Traits, K, std::enable_if_t<Traits<K>::expires>> : std::true_type {};
+
+// Weak pointers in a key do not keep their object alive. They are compared
+// by owner so that a key stays intact when its object dies. Once the object
+// is gone, the entry can never be found again and gets dropped.
+template <typename T>
+struct KeyComponent<std::weak_ptr<T>> {
+  static constexpr bool expires = true;
+
+  static std::size_t hash(const std::weak_ptr<T>& key) {
+#if __cpp_lib_smart_ptr_owner_equality >= 202306L
+    return std::owner_hash{}(key);
+#else
+    // Without std::owner_hash we hash the address of the object. Pointers
+    // that share an owner but point to different objects (created with the
+    // aliasing constructor) can therefore lead to separate entries.
+    return std::hash<T*>{}(key.lock().get());
+#endif
+  }
+
+  static bool equal(const std::weak_ptr<T>& lhs, const std::weak_ptr<T>& rhs) {
+    return !lhs.owner_before(rhs) && !rhs.owner_before(lhs);
+  }
+
+  static bool expired(const std::weak_ptr<T>& key) { return key.expired(); }
+};
+
+// How a factory decides which of the released values that it keeps alive
+// to drop, see UniqueFactory::retain().
+enum class RetentionPolicy {
+  // Drop the least recently used value.
+  LRU,
+  // Go round robin through the values and drop the first one that has not
+  // been used since the last round (CLOCK, also known as second chance.)
+  // Values are kept alive from the moment they are handed out, so the
+  // capacity includes values that are still in use. In exchange, handing
+  // out a retained value again only takes a shared lock on the factory and
+  // marks the value as used with a single atomic store.
+  CLOCK,
+  // Drop the value that is cheapest to recreate, measured by the time its
+  // create() took, while aging values that have not been used for a while
+  // (GreedyDual-Size.)
+  GREEDY_DUAL,
+};
+
+// How a factory decides whether to keep a released value alive when that
+// means dropping another one, see UniqueFactory::admit().
+enum class AdmissionPolicy {
+  // Always keep the released value.
+  ALL,
+  // Only keep the released value if its key has been asked for more often
+  // recently than the key of the value it would replace (TinyLFU.) Keys are
+  // counted approximately in a count-min sketch, so a burst of keys that are
+  // used only once does not flush the values that are used all the time.
+  TINY_LFU,
+};
+
+// How urgently a factory should give memory back, see
+// UniqueFactory::on_memory_pressure().
+enum class MemoryPressure {
+  NONE,
+  // Drop half of the released values that the factory keeps alive.
+  MODERATE,
+  // Drop all released values that the factory keeps alive and shrink the
+  // table to its size.
+  CRITICAL,
+};
+
+// What was left in a factory with weak values when it was destroyed, see
+// UniqueFactory::on_teardown().
+struct TeardownReport {
+  // The number of values created by the factory that were still alive.
+  std::size_t leaked = 0;
+  // An estimate of the bytes held by these values and their entries.
+  std::size_t bytes = 0;
+};
+
+// Reports a factory that is destroyed while some of its values are still
+// alive on standard error unless NDEBUG is defined.
+inline void report_leaks(const TeardownReport& report) {
+#ifndef NDEBUG
+  if (report.leaked != 0)
+    std::fprintf(stderr, "A unique factory is leaking memory. %zu objects (about %zu bytes) were created through a C++ unique factory but never released. These objects might be part of a legitimate cache that is (unfortunately) not explicitly released upon program termination as is common in garbage-collocting languages such as Python.\n", report.leaked, report.bytes);
+#else
+  (void)report;
+#endif
+}
+
+// How much memory a factory uses in bytes, see
+// UniqueFactory::memory_usage(). Some of these are estimates since the
+// standard library does not tell how large its allocations are.
+struct MemoryUsage {
+  // The array of buckets of the hash table.
+  std::size_t buckets = 0;
+  // The entries of the table, including the keys and, for memo tables, the
+  // values themselves.
+  std::size_t nodes = 0;
+  // What the keys allocated on the heap as reported by the caller.
+  std::size_t keys = 0;
+  // The control blocks of the std::shared_ptr handed out for the values and
+  // of the values that the factory keeps alive.
+  std::size_t control_blocks = 0;
+  // The values that the factory keeps alive as measured by the size_of of
+  // retain_bytes() or sizeof the values otherwise.
+  std::size_t retained = 0;
+  // The factory itself and the data structures of the retention policies.
+  std::size_t bookkeeping = 0;
+
+  std::size_t total() const { return buckets + nodes + keys + control_blocks + retained + bookkeeping; }
+};
+
+#ifdef UNIQUE_FACTORY_STATISTICS
+// A histogram of durations. Each power of two of nanoseconds is split into
+// eight buckets of equal width (log-linear) so that percentiles are off by at
+// most 12.5% while the histogram has a fixed size.
+struct Histogram {
+  static constexpr unsigned int linear = 3;
+  static constexpr std::size_t size = (64 - linear + 1) << linear;
+
+  std::uint64_t counts[size] = {};
+
+  // Return the bucket that a duration of this many nanoseconds goes to.
+  static std::size_t bucket(std::uint64_t nanoseconds) {
+    if (nanoseconds < (std::uint64_t(1) << linear))
+      return std::size_t(nanoseconds);
+
+    unsigned int exponent = linear;
+    while (exponent < 63 && nanoseconds >> (exponent + 1) != 0)
+      exponent++;
+    return (std::size_t(exponent - linear + 1) << linear) + std::size_t((nanoseconds >> (exponent - linear)) & ((1u << linear) - 1));
+  }
+
+  // Return the smallest number of nanoseconds that goes to this bucket.
+  static std::uint64_t lower(std::size_t bucket) {
+    if (bucket < (std::size_t(1) << linear))
+      return bucket;
+
+    const unsigned int exponent = unsigned(bucket >> linear) + linear - 1;
+    return ((std::uint64_t(1) << linear) + (bucket & ((1u << linear) - 1))) << (exponent - linear);
+  }
+
+  // Return the number of recorded durations.
+  std::uint64_t count() const {
+    std::uint64_t ret = 0;
+    for (std::uint64_t c : counts)
+      ret += c;
+    return ret;
+  }
+
+  // Return a duration that at least the fraction p (between 0 and 1) of the
+  // recorded durations do not exceed, i.e., the upper end of the bucket
+  // that contains the p-th percentile; zero if nothing has been recorded.
+  std::chrono::nanoseconds percentile(double p) const {
+    const std::uint64_t total = count();
+    if (total == 0)
+      return std::chrono::nanoseconds::zero();
+
+    const std::uint64_t rank = std::max<std::uint64_t>(1, std::uint64_t(std::min(1., std::max(0., p)) * double(total) + .5));
+    std::uint64_t seen = 0;
+    for (std::size_t bucket = 0; bucket < size; bucket++) {
+      seen += counts[bucket];
+      if (seen >= rank)
+        return std::chrono::nanoseconds(bucket + 1 == size ? std::numeric_limits<std::chrono::nanoseconds::rep>::max() : std::chrono::nanoseconds::rep(lower(bucket + 1) - 1));
+    }
+    return std::chrono::nanoseconds::zero();
+  }
+};
+
+// What a factory has been doing, see UniqueFactory::statistics(). Only
+// available if UNIQUE_FACTORY_STATISTICS is defined before including this
+// header.
+struct Statistics {
+  // Lookups that found a value and lookups that did not; a get() that has
+  // to create its value is a miss.
+  std::uint64_t hits = 0;
+  std::uint64_t misses = 0;
+  // Values that were created again because their previous value had been
+  // released but its entry was still in the table.
+  std::uint64_t recreations = 0;
+  // Entries that were dropped when their value was released.
+  std::uint64_t erasures = 0;
+  // The current and the largest number of entries in the table.
+  std::uint64_t size = 0;
+  std::uint64_t peak = 0;
+  // How often the table has been resized.
+  std::uint64_t rehashes = 0;
+  // How long the successful calls to create() in get() took.
+  Histogram creation;
+  // How often the mutex of the factory was not available right away, how
+  // long we waited for it in total, and the longest wait.
+  std::uint64_t contentions = 0;
+  std::chrono::nanoseconds wait = std::chrono::nanoseconds::zero();
+  std::chrono::nanoseconds longest_wait = std::chrono::nanoseconds::zero();
+};
+#endif
+
+// The default observer of a factory, see BasicUniqueFactory. Observers
+// that are only interested in some of the events can derive from this.
+struct NoObserver {
+  // A lookup found a value for this key.
+  template <typename... Key>
+  void on_hit(const Key&...) {}
+  // A lookup found no value for this key; for get() this means that the
+  // value is about to be created.
+  template <typename... Key>
+  void on_miss(const Key&...) {}
+  // get() created this value for this key.
+  template <typename Value, typename... Key>
+  void on_created(const Value&, const Key&...) {}
+  // The last reference to the value for this key outside the factory went
+  // away.
+  template <typename... Key>
+  void on_released(const Key&...) {}
+  // The entry for this key has been removed from the table.
+  template <typename... Key>
+  void on_erased(const Key&...) {}
+};
+
+// A factory that makes sure that there is at most one value for each key
+// (which might consist of several components.)
+//
+// If Value is a std::weak_ptr<T>, the factory hands out std::shared_ptr<T>
+// but does not keep these values alive itself. Otherwise, the factory is a
+// memo table that stores each Value and hands out copies of it.
+//
+// Components of the key that are a std::weak_ptr are not kept alive by the
+// factory; the entry goes away with them. The same holds for components
+// whose Traits declare that they expire.
+//
+// Each component K of the key is hashed and compared with Traits<K>, see
+// KeyComponent; UniqueFactory uses KeyComponent itself.
+//
+// The factory reports what it does to an Observer, see NoObserver. Except
+// for on_created() and on_released(), its callbacks might be invoked while
+// the factory is locked so they must not call into the factory. Lookups
+// that hit or miss only hold the factory shared, so the callbacks might run
+// in several threads at once and must be thread-safe.
+template <typename Observer, template <typename> class Traits, typename Value, typename... Key>
+class BasicUniqueFactory {
+  static_assert(sizeof...(Key) != 0, "a unique factory needs a key");
+
+  static constexpr bool weak_values = is_weak_ptr<Value>::value;
+  static constexpr bool weak_keys = (expires<Traits, Key>::value || ...);
+
+  template <typename V>
+  struct element { using type = V; };
+
+  template <typename T>
+  struct element<std::weak_ptr<T>> { using type = T; };
+
+  // The type of the objects handed out by a factory with weak values.
+  using Object = typename element<Value>::type;
+
+  template <typename K>
+  struct tracked { using type = K; };
+
+  template <typename T>
+  struct tracked<std::shared_ptr<T>> { using type = std::weak_ptr<T>; };
+
+  // A key as held by track_hot_keys(); shared pointers are held weakly so
+  // that tracking a key does not keep its objects alive.
+  using TrackedKey = std::tuple<typename tracked<Key>::type...>;
+
+  // The rough layout of the control block of a std::shared_ptr with this
+  // deleter, only used to estimate memory_usage().
+  template <typename D>
+  struct ControlBlock {
+    virtual ~ControlBlock() = default;
+    int uses;
+    int weaks;
+    Object* pointer;
+    D deleter;
+  };
+
+ public:
+  // The type returned by get(), i.e., std::shared_ptr<T> for weak values
+  // and Value otherwise.
+  using value_type = std::conditional_t<weak_values, std::shared_ptr<Object>, Value>;
+
+  // The type returned by find() and try_get() which can also express that
+  // there is no value.
+  using optional_type = std::conditional_t<weak_values, std::shared_ptr<Object>, std::optional<Value>>;
+
+ private:
+  // Lookups that find a value that is alive only take a shared lock; all
+  // modifications of the table happen under an exclusive lock.
+  std::shared_mutex mutex;
+
+  // Signaled whenever a construction in get() completes so that threads
+  // waiting for that key can pick up the result.
+  std::condition_variable_any constructed;
+
+  struct Node;
+
+  // The part of a node with weak values that lets the factory keep a
+  // released value alive, see retain().
+  struct RetentionHook {
+    // The object of a released value that the factory keeps alive.
+    std::shared_ptr<Object> retained;
+    // The value handed out for this node if it has been pinned, see pin().
+    std::shared_ptr<Object> pinned;
+    // The value handed out for this node while RetentionPolicy::CLOCK keeps
+    // it alive and, once it has been evicted, until the lock is released.
+    std::shared_ptr<Object> held;
+    std::shared_ptr<Object> evicted;
+    // The neighbours in the list of retained values.
+    Node* newer = nullptr;
+    Node* older = nullptr;
+    // Whether the value has been used recently, see RetentionPolicy::CLOCK.
+    std::atomic<bool> referenced{false};
+    // When the value was released, see retain_for().
+    std::chrono::steady_clock::time_point released;
+    // The seconds it took to create the value.
+    double cost = 0;
+    // The size of the value as reported by the size_of of retain_bytes().
+    std::size_t bytes = 0;
+    // The priority of this value and its position in the heap of retained
+    // values, see RetentionPolicy::GREEDY_DUAL.
+    double priority = 0;
+    std::size_t position = 0;
+  };
+
+  struct NoRetentionHook {};
+
+  // An entry of the cache. We keep the hash of the key so that callers that
+  // know it already do not have to pay for hash() and so that rehashing the
+  // table never needs to hash keys again.
+  struct Node : std::conditional_t<weak_values, RetentionHook, NoRetentionHook> {
+    Node(std::size_t hash, const Key&... key) :
+      hash(hash),
+      key(key...) {}
+
+    Node* next = nullptr;
+    const std::size_t hash;
+    const std::tuple<Key...> key;
+    // A weak pointer to the value or the value itself; the latter is only
+    // missing while the value is being created.
+    std::conditional_t<weak_values, Value, std::optional<Value>> value;
+    // The thread currently creating the value for this key or a
+    // default-constructed id if no construction is in progress.
+    std::thread::id creator;
+    // Whether this node is still in the table. With weak values, once a
+    // value has been created for a node, the node belongs to the value's
+    // Deleter which frees it; the table might unlink it earlier if its key
+    // expired or if the value expired and is recreated before the Deleter
+    // had a chance to run. When the factory keeps a released value alive,
+    // the node belongs to the table again. Without weak values, nodes always
+    // belong to the table.
+    bool linked = true;
+  };
+
+  // A chained hash table with a power of two number of buckets. Keys are
+  // assigned to buckets by the top bits of their (mixed) hash.
+  std::vector<Node*> buckets;
+  std::size_t size = 0;
+  unsigned int bits = 0;
+
+  // The next bucket that sweep() looks at. Since buckets are assigned by the
+  // top bits of the hash, bucket i becomes buckets 2i and 2i+1 when the
+  // table doubles so the sweep can continue where it left off.
+  std::size_t cursor = 0;
+
+  // Nodes that have been dropped from the table but can only be freed once
+  // the mutex has been released, see Lock.
+  Node* garbage = nullptr;
+
+  // Pinned nodes that have been dropped from the table. Their pins can only
+  // be released once the mutex has been released since that might run
+  // their Deleter, see Lock.
+  Node* unpinned = nullptr;
+
+  // Nodes whose value RetentionPolicy::CLOCK stopped holding on to, linked
+  // by newer. Their values can only be released once the mutex has been
+  // released, see Lock.
+  Node* evicted = nullptr;
+
+  // The released values that the factory keeps alive, see retain(). Since
+  // a value is only in this list while nobody else holds on to it, the list
+  // is ordered by the time the values were last used. With
+  // RetentionPolicy::CLOCK, the list holds the values that have been handed
+  // out in the order they were handed out instead.
+  struct Retention {
+    RetentionPolicy policy = RetentionPolicy::LRU;
+    std::size_t capacity = 0;
+    // How long released values are kept alive at most; zero for no limit.
+    std::chrono::steady_clock::duration ttl = std::chrono::steady_clock::duration::zero();
+    // How many bytes the retained values may take up and how to measure a
+    // value, see retain_bytes().
+    std::size_t budget = std::numeric_limits<std::size_t>::max();
+    std::function<std::size_t(const Object&)> size_of;
+    std::size_t count = 0;
+    // The total of the bytes of the retained values.
+    std::size_t bytes = 0;
+    Node* newest = nullptr;
+    Node* oldest = nullptr;
+    // The next node to consider for eviction with RetentionPolicy::CLOCK;
+    // the hand moves from older to newer values and wraps around.
+    Node* hand = nullptr;
+    // A min-heap of the retained values by priority and the priority of the
+    // last value that was dropped, see RetentionPolicy::GREEDY_DUAL.
+    std::vector<Node*> heap;
+    double inflation = 0;
+
+    AdmissionPolicy admission = AdmissionPolicy::ALL;
+
+    // How often keys have been asked for recently, see
+    // AdmissionPolicy::TINY_LFU. Each row of the sketch consists of width
+    // four bit counters, sixteen to an atomic word, so that lookups that only
+    // hold a shared lock can count.
+    struct Sketch {
+      static constexpr int rows = 4;
+
+      unsigned int bits = 0;
+      std::vector<std::atomic<std::uint64_t>> words;
+      // The number of increments since the counters were last halved.
+      std::atomic<std::size_t> additions{0};
+
+      void resize(std::size_t capacity) {
+        bits = 6;
+        while (bits < 20 && (std::size_t(1) << bits) < capacity)
+          bits++;
+        words = std::vector<std::atomic<std::uint64_t>>((std::size_t(rows) << bits) / 16);
+        additions = 0;
+      }
+
+      // Return the position of the counter for this hash in a row.
+      std::size_t counter(std::size_t hash, int row) const {
+        constexpr std::uint64_t seeds[rows] = {0x9E3779B97F4A7C15ull, 0xC2B2AE3D27D4EB4Full, 0x165667B19E3779F9ull, 0xD6E8FEB86659FD93ull};
+        return (std::size_t(row) << bits) + std::size_t((std::uint64_t(hash) * seeds[row]) >> (64 - bits));
+      }
+
+      void record(std::size_t hash) {
+        for (int row = 0; row < rows; row++) {
+          const std::size_t position = counter(hash, row);
+          auto& word = words[position / 16];
+          const unsigned int shift = 4 * (position % 16);
+          std::uint64_t value = word.load(std::memory_order_relaxed);
+          while (((value >> shift) & 0xF) != 0xF && !word.compare_exchange_weak(value, value + (std::uint64_t(1) << shift), std::memory_order_relaxed)) {}
+        }
+
+        // Halve all counters periodically so that the sketch forgets keys
+        // that are not used anymore.
+        const std::size_t sample = std::size_t(10) << bits;
+        if (additions.fetch_add(1, std::memory_order_relaxed) + 1 == sample) {
+          for (auto& word : words) {
+            std::uint64_t value = word.load(std::memory_order_relaxed);
+            while (!word.compare_exchange_weak(value, (value >> 1) & 0x7777777777777777ull, std::memory_order_relaxed)) {}
+          }
+          additions.fetch_sub(sample / 2, std::memory_order_relaxed);
+        }
+      }
+
+      unsigned int estimate(std::size_t hash) const {
+        unsigned int ret = 0xF;
+        for (int row = 0; row < rows; row++) {
+          const std::size_t position = counter(hash, row);
+          ret = std::min(ret, unsigned((words[position / 16].load(std::memory_order_relaxed) >> (4 * (position % 16))) & 0xF));
+        }
+        return ret;
+      }
+    } sketch;
+
+    void configure(RetentionPolicy policy) {
+      if (policy == this->policy)
+        return;
+
+      this->policy = policy;
+
+      heap.clear();
+      if (policy == RetentionPolicy::GREEDY_DUAL)
+        for (Node* node = oldest; node != nullptr; node = node->newer)
+          enqueue(node);
+    }
+
+    void push(Node* node) {
+      node->referenced.store(false, std::memory_order_relaxed);
+      node->newer = nullptr;
+      node->older = newest;
+      (newest == nullptr ? oldest : newest->newer) = node;
+      newest = node;
+      count++;
+      bytes += node->bytes;
+
+      if (policy == RetentionPolicy::GREEDY_DUAL)
+        enqueue(node);
+    }
+
+    void remove(Node* node) {
+      if (hand == node)
+        hand = node->newer;
+      if (policy == RetentionPolicy::GREEDY_DUAL)
+        dequeue(node);
+      (node->newer == nullptr ? newest : node->newer->older) = node->older;
+      (node->older == nullptr ? oldest : node->older->newer) = node->newer;
+      node->newer = nullptr;
+      node->older = nullptr;
+      count--;
+      bytes -= node->bytes;
+    }
+
+    // Return the node that should be dropped next.
+    Node* victim() {
+      if (policy == RetentionPolicy::LRU)
+        return oldest;
+
+      if (policy == RetentionPolicy::GREEDY_DUAL)
+        return heap.front();
+
+      while (true) {
+        if (hand == nullptr)
+          hand = oldest;
+        Node* node = hand;
+        hand = node->newer;
+        if (!node->referenced.exchange(false, std::memory_order_relaxed))
+          return node;
+      }
+    }
+
+    void enqueue(Node* node) {
+      // With a size_of, prefer to drop large values (GreedyDual-Size.)
+      node->priority = inflation + (node->bytes == 0 ? node->cost : node->cost / node->bytes);
+      node->position = heap.size();
+      heap.push_back(node);
+      up(node->position);
+    }
+
+    void dequeue(Node* node) {
+      Node* last = heap.back();
+      heap.pop_back();
+      if (last != node) {
+        heap[node->position] = last;
+        last->position = node->position;
+        up(last->position);
+        down(last->position);
+      }
+    }
+
+    void up(std::size_t position) {
+      while (position != 0) {
+        std::size_t parent = (position - 1) / 2;
+        if (heap[parent]->priority <= heap[position]->priority)
+          break;
+        swap(position, parent);
+        position = parent;
+      }
+    }
+
+    void down(std::size_t position) {
+      while (true) {
+        std::size_t smallest = position;
+        for (std::size_t child = 2 * position + 1; child <= 2 * position + 2 && child < heap.size(); child++)
+          if (heap[child]->priority < heap[smallest]->priority)
+            smallest = child;
+        if (smallest == position)
+          break;
+        swap(position, smallest);
+        position = smallest;
+      }
+    }
+
+    void swap(std::size_t i, std::size_t j) {
+      std::swap(heap[i], heap[j]);
+      heap[i]->position = i;
+      heap[j]->position = j;
+    }
+  } retention;
+
+  // A thread that runs a task every interval until it is destroyed.
+  class Periodic {
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stop = false;
+    std::thread thread;
+
+   public:
+    template <typename Task>
+    Periodic(std::chrono::steady_clock::duration interval, Task&& task) :
+      thread([this, interval, task = std::forward<Task>(task)]() mutable {
+        while (true) {
+          {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (wake.wait_for(lock, interval, [&]() { return stop; }))
+              return;
+          }
+          task();
+        }
+      }) {}
+
+    Periodic(const Periodic&) = delete;
+    Periodic& operator=(const Periodic&) = delete;
+
+    ~Periodic() {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+      }
+      wake.notify_all();
+      thread.join();
+    }
+  };
+
+  // The keys that are requested most often with get() and the keys whose
+  // values are created most often, approximated with the Space-Saving
+  // algorithm, see track_hot_keys(). Keys are told apart by their hash.
+  class TopK {
+    struct Slot {
+      std::size_t hash;
+      TrackedKey key;
+      std::uint64_t count;
+      std::uint64_t error;
+    };
+
+    std::size_t capacity;
+    std::vector<Slot> slots;
+
+   public:
+    explicit TopK(std::size_t capacity) :
+      capacity(capacity) {
+      slots.reserve(capacity);
+    }
 
-  std::unordered_map<Key, std::weak_ptr<Value>, Hash, KeyEqual> cache;
+    // Count this key; return the key that it replaced, if any, which the
+    // caller must destroy without holding the lock of the factory.
+    std::optional<TrackedKey> add(std::size_t hash, const Key&... key) {
+      for (auto& slot : slots) {
+        if (slot.hash == hash) {
+          slot.count++;
+          return std::nullopt;
+        }
+      }
 
+      if (slots.size() < capacity) {
+        slots.push_back({hash, TrackedKey(key...), 1, 0});
+        return std::nullopt;
+      }
+
+      // Replace the key with the smallest count; the newcomer might have
+      // been seen that often before without being tracked.
+      auto& slot = *std::min_element(slots.begin(), slots.end(), [](const Slot& lhs, const Slot& rhs) { return lhs.count < rhs.count; });
+      std::optional<TrackedKey> replaced(std::move(slot.key));
+      slot = {hash, TrackedKey(key...), slot.count + 1, slot.count};
+      return replaced;
+    }
+
+    // Return the tracked keys that have been seen at least minimum times
+    // for sure, the most frequent first.
+    template <typename HotKey>
+    std::vector<HotKey> top(std::uint64_t minimum) const {
+      std::vector<HotKey> ret;
+      for (const auto& slot : slots)
+        if (slot.count - slot.error >= minimum)
+          ret.push_back({slot.key, slot.count, slot.error});
+      std::sort(ret.begin(), ret.end(), [](const HotKey& lhs, const HotKey& rhs) { return lhs.count > rhs.count; });
+      return ret;
+    }
+  };
+
+  struct HotKeys {
+    explicit HotKeys(std::size_t capacity) :
+      requests(capacity),
+      creations(capacity) {}
+
+    std::mutex mutex;
+    TopK requests;
+    TopK creations;
+  };
+
+  std::unique_ptr<HotKeys> hot;
+
+  // What happens when the factory is destroyed, see on_teardown() and
+  // skip_teardown().
+  void (*reporter)(const TeardownReport&) = &report_leaks;
+  bool teardown = true;
+
+  // Whether register_as() added this factory to the registry; other
+  // factories never touch the registry.
+  bool registered = false;
+
+  // The threads started by sweep_every(), monitor_memory_pressure(), and
+  // retain_for().
+  std::unique_ptr<Periodic> sweeper;
+  std::unique_ptr<Periodic> monitor;
+  std::unique_ptr<Periodic> expirer;
+
+#ifdef UNIQUE_FACTORY_STATISTICS
+  // The counters behind statistics(). Hits and misses are counted in
+  // stripes so that threads that only hold a shared lock do not contend on
+  // them; the other counters only change under the exclusive lock.
+  struct Counters {
+    struct alignas(64) Stripe {
+      std::atomic<std::uint64_t> hits{0};
+      std::atomic<std::uint64_t> misses{0};
+      std::atomic<std::uint64_t> contentions{0};
+      // Nanoseconds spent waiting for the mutex.
+      std::atomic<std::uint64_t> wait{0};
+    };
+
+    static constexpr std::size_t stripes = 16;
+    Stripe stripe[stripes];
+    std::uint64_t recreations = 0;
+    std::uint64_t erasures = 0;
+    std::uint64_t peak = 0;
+    std::uint64_t rehashes = 0;
+    // Constructions happen outside of the lock, so their histogram is made
+    // of atomic buckets.
+    std::atomic<std::uint64_t> creation[Histogram::size] = {};
+    std::atomic<std::uint64_t> longest_wait{0};
+
+    // Return the stripe of the current thread.
+    Stripe& local() {
+      static thread_local const std::size_t index = std::size_t((std::uint64_t(std::hash<std::thread::id>{}(std::this_thread::get_id())) * 0x9E3779B97F4A7C15ull) >> 60) % stripes;
+      return stripe[index];
+    }
+
+    void hit() { local().hits.fetch_add(1, std::memory_order_relaxed); }
+    void miss() { local().misses.fetch_add(1, std::memory_order_relaxed); }
+    void recreation() { recreations++; }
+    void erasure() { erasures++; }
+    void grow(std::size_t size) { peak = std::max<std::uint64_t>(peak, size); }
+    void rehash() { rehashes++; }
+
+    static constexpr bool timed = true;
+    void created(std::chrono::steady_clock::duration duration) {
+      creation[Histogram::bucket(nanoseconds(duration))].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void contended(std::chrono::steady_clock::duration duration) {
+      const std::uint64_t wait = nanoseconds(duration);
+      Stripe& stripe = local();
+      stripe.contentions.fetch_add(1, std::memory_order_relaxed);
+      stripe.wait.fetch_add(wait, std::memory_order_relaxed);
+      std::uint64_t longest = longest_wait.load(std::memory_order_relaxed);
+      while (wait > longest && !longest_wait.compare_exchange_weak(longest, wait, std::memory_order_relaxed)) {}
+    }
+
+    static std::uint64_t nanoseconds(std::chrono::steady_clock::duration duration) {
+      return std::uint64_t(std::max<std::chrono::nanoseconds::rep>(0, std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count()));
+    }
+  };
+#else
+  struct Counters {
+    void hit() {}
+    void miss() {}
+    void recreation() {}
+    void erasure() {}
+    void grow(std::size_t) {}
+    void rehash() {}
+
+    static constexpr bool timed = false;
+    void created(std::chrono::steady_clock::duration) {}
+    void contended(std::chrono::steady_clock::duration) {}
+  };
+#endif
+
+  Counters counters;
+
+#if __has_cpp_attribute(no_unique_address)
+  [[no_unique_address]]
+#endif
+  Observer observer;
+
+  // Lock the mutex exclusively or shared, depending on the guard. With
+  // statistics, we first try to get it without blocking so that we only pay
+  // for measuring the wait if there is one.
+  template <typename Guard>
+  void acquire(Guard& guard) {
+    if constexpr (Counters::timed) {
+      if (guard.try_lock())
+        return;
+      const auto start = std::chrono::steady_clock::now();
+      guard.lock();
+      counters.contended(std::chrono::steady_clock::now() - start);
+    } else {
+      guard.lock();
+    }
+  }
+
+  // A lock on the factory. Nodes dropped from the table while the lock is
+  // held are freed when it is released since destroying their keys and
+  // values might call back into this factory.
+  class Lock {
+    BasicUniqueFactory& factory;
+    std::unique_lock<std::shared_mutex> guard;
+
+   public:
+    explicit Lock(BasicUniqueFactory& factory) :
+      factory(factory),
+      guard(factory.mutex, std::defer_lock) {
+      lock();
+    }
+
+    Lock(const Lock&) = delete;
+    Lock& operator=(const Lock&) = delete;
+
+    ~Lock() { unlock(); }
+
+    void lock() { factory.acquire(guard); }
+
+    void unlock() {
+      if (!guard.owns_lock())
+        return;
+
+      Node* garbage = std::exchange(factory.garbage, nullptr);
+      Node* unpinned = std::exchange(factory.unpinned, nullptr);
+      Node* evicted = std::exchange(factory.evicted, nullptr);
+      guard.unlock();
+
+      while (garbage != nullptr)
+        delete std::exchange(garbage, garbage->next);
+
+      if constexpr (weak_values) {
+        // The Deleter frees the node when we release its pin.
+        while (unpinned != nullptr)
+          std::exchange(unpinned, unpinned->next)->pinned.reset();
+
+        // Nobody else touches these nodes while we hold on to their value;
+        // the Deleter frees them when we let go if they are not in the table.
+        while (evicted != nullptr)
+          std::exchange(evicted, evicted->newer)->evicted.reset();
+      }
+    }
+
+    // Wait until a construction in another thread completes.
+    void wait() { factory.constructed.wait(guard); }
+  };
+
+  // The Deleter of the values handed out by a factory with weak values.
+  // Owner holds on to the object that create() returned; typically a
+  // std::unique_ptr but a std::shared_ptr when create() returned one.
+  template <typename Owner>
   class Deleter {
-    UniqueFactory* factory;
-    Key key;
+    BasicUniqueFactory* factory;
+    Node* node;
+    Owner owner;
 
    public:
-    Deleter(UniqueFactory* factory, const Key& key) :
+    Deleter(BasicUniqueFactory* factory, Node* node, Owner&& owner) :
       factory(factory),
-      key(key) {}
+      node(node),
+      owner(std::move(owner)) {}
 
-    void operator()(Value* value) const {
-      factory->cache.erase(key);
-      delete value;
+    void operator()(Object*) {
+      LIBUNIQUEFACTORY_PROBE(release, factory, node->hash);
+      factory->release(node, owner);
+      owner.reset();
     }
   };
 
+  // Take ownership of what create() returned in a factory with weak values,
+  // a pointer, a std::unique_ptr, a std::shared_ptr, or an actual Object.
+  template <typename Result>
+  static auto own(Result&& result) {
+    using R = std::decay_t<Result>;
+    if constexpr (std::is_convertible_v<R, std::unique_ptr<Object>>)
+      return std::unique_ptr<Object>(std::forward<Result>(result));
+    else if constexpr (std::is_convertible_v<R, std::shared_ptr<Object>>)
+      return std::shared_ptr<Object>(std::forward<Result>(result));
+    else if constexpr (std::is_pointer_v<R>)
+      return std::unique_ptr<Object>(result);
+    else
+      return std::make_unique<Object>(std::forward<Result>(result));
+  }
+
+  // Fibonacci hashing, so that std::hash being the identity on integers
+  // does not put all multiples of the bucket count into the same bucket.
+  static std::size_t mix(std::size_t hash) {
+    constexpr std::size_t golden = sizeof(std::size_t) == 8 ? std::size_t(0x9E3779B97F4A7C15ull) : std::size_t(0x9E3779B9ul);
+    return hash * golden;
+  }
+
+  std::size_t bucket(std::size_t hash) const {
+    return mix(hash) >> (sizeof(std::size_t) * 8 - bits);
+  }
+
+  // Return whether the key of this node is the given key; the components are
+  // compared one by one without building a tuple from them.
+  static bool equal(const Node* node, const Key&... key) {
+    return std::apply([&](const Key&... stored) { return (Traits<Key>::equal(stored, key) && ...); }, node->key);
+  }
+
+  // Return whether a component of the key of this node has expired, i.e.,
+  // whether this node can never be looked up again.
+  static bool dead(const Node* node) {
+    if constexpr (weak_keys) {
+      if (node->creator != std::thread::id())
+        return false;
+      return std::apply([](const Key&... stored) { return (Traits<Key>::expired(stored) || ...); }, node->key);
+    } else {
+      return false;
+    }
+  }
+
+  // Return the node for this key. Nodes with an expired key that we come
+  // across on the way are dropped from the table.
+  Node* lookup(std::size_t hash, const Key&... key) {
+    if (buckets.empty())
+      return nullptr;
+
+    Node** link = &buckets[bucket(hash)];
+    while (Node* node = *link) {
+      if (dead(node)) {
+        drop(link);
+        continue;
+      }
+      if (node->hash == hash && equal(node, key...))
+        return node;
+      link = &node->next;
+    }
+
+    return nullptr;
+  }
+
+  // Return the node for this key without modifying the table, i.e., this
+  // only needs a shared lock.
+  Node* search(std::size_t hash, const Key&... key) const {
+    if (buckets.empty())
+      return nullptr;
+
+    for (Node* node = buckets[bucket(hash)]; node != nullptr; node = node->next)
+      if (node->hash == hash && equal(node, key...))
+        return dead(node) ? nullptr : node;
+
+    return nullptr;
+  }
+
+  Node* insert(std::size_t hash, const Key&... key) {
+    // Every insertion sweeps a few buckets, so dead entries do not pile up
+    // in parts of the table that are never looked at.
+    sweep(2);
+
+    if (size >= buckets.size()) {
+      // Before growing the table, drop the entries whose key expired. We
+      // only skip growing if that freed at least half of the table so the
+      // cost of purging is amortized by the insertions.
+      purge();
+      if (size >= buckets.size() / 2)
+        rehash(buckets.empty() ? 3 : bits + 1);
+    }
+
+    Node* node = new Node(hash, key...);
+    Node*& head = buckets[bucket(hash)];
+    node->next = head;
+    head = node;
+    size++;
+    counters.grow(size);
+    return node;
+  }
+
+  // Remove the node at this position of a chain from the table.
+  void unlink(Node** link) {
+    Node* node = *link;
+    *link = node->next;
+    node->linked = false;
+    size--;
+    std::apply([&](const Key&... key) { observer.on_erased(key...); }, node->key);
+  }
+
+  void unlink(Node* node) {
+    Node** link = &buckets[bucket(node->hash)];
+    while (*link != node)
+      link = &(*link)->next;
+    unlink(link);
+  }
+
+  // Remove the node at this position of a chain from the table and free it
+  // once the lock has been released unless it belongs to a Deleter.
+  void drop(Node** link) {
+    Node* node = *link;
+    unlink(link);
+    if constexpr (weak_values) {
+      if (node->held != nullptr)
+        forget(node);
+      if (node->pinned != nullptr) {
+        node->next = unpinned;
+        unpinned = node;
+        return;
+      }
+      if (node->retained == nullptr)
+        return;
+      retention.remove(node);
+    }
+    node->next = garbage;
+    garbage = node;
+  }
+
+  void drop(Node* node) {
+    Node** link = &buckets[bucket(node->hash)];
+    while (*link != node)
+      link = &(*link)->next;
+    drop(link);
+  }
+
+  // Drop retained values until the retention policy is satisfied.
+  void evict() {
+    expire();
+    while (retention.count > retention.capacity || retention.bytes > retention.budget)
+      evict(retention.victim());
+  }
+
+  // Drop a retained value that the retention policy picked.
+  void evict(Node* victim) {
+    // All values that stay are now closer to being dropped.
+    if (retention.policy == RetentionPolicy::GREEDY_DUAL)
+      retention.inflation = victim->priority;
+    forget(victim);
+  }
+
+  // Stop keeping the value of this node alive. A released value is dropped
+  // with its node; a value that RetentionPolicy::CLOCK holds on to is
+  // released once the lock has been released and its node stays in the
+  // table until its Deleter runs.
+  void forget(Node* node) {
+    if (node->held == nullptr) {
+      drop(node);
+      return;
+    }
+
+    retention.remove(node);
+    node->evicted = std::move(node->held);
+    node->newer = evicted;
+    evicted = node;
+  }
+
+  // Make room for the value of this node among the retained values; returns
+  // whether the admission policy lets it in.
+  bool room(Node* node) {
+    if (node->bytes > retention.budget)
+      return false;
+
+    if (retention.admission == AdmissionPolicy::TINY_LFU && (retention.count >= retention.capacity || retention.bytes + node->bytes > retention.budget)) {
+      Node* victim = retention.victim();
+      if (retention.sketch.estimate(node->hash) <= retention.sketch.estimate(victim->hash))
+        return false;
+      evict(victim);
+    }
+
+    return true;
+  }
+
+  // Count that this key has been asked for, see AdmissionPolicy::TINY_LFU;
+  // a shared lock suffices.
+  void record(std::size_t hash) {
+    if constexpr (weak_values) {
+      if (retention.admission == AdmissionPolicy::TINY_LFU)
+        retention.sketch.record(hash);
+    }
+  }
+
+  // Drop retained values that were released longer than the time to live
+  // ago. All values live equally long, so they expire in the order they
+  // were released, which is the order of the list of retained values; the
+  // list is effectively a timer wheel with a single slot.
+  void expire() {
+    if constexpr (weak_values) {
+      if (retention.ttl == std::chrono::steady_clock::duration::zero() || retention.count == 0)
+        return;
+
+      const auto now = std::chrono::steady_clock::now();
+      while (retention.oldest != nullptr && now - retention.oldest->released >= retention.ttl)
+        forget(retention.oldest);
+    }
+  }
+
+  // Keep the object of this node alive after its last reference outside the
+  // factory has gone away if the retention policy wants us to. Returns
+  // whether the node now belongs to the table again. RetentionPolicy::CLOCK
+  // holds on to values when they are handed out instead, see hold().
+  template <typename Owner>
+  bool park(Node* node, Owner& owner) {
+    if (!node->linked || node->creator != std::thread::id() || retention.capacity == 0 || retention.policy == RetentionPolicy::CLOCK || dead(node))
+      return false;
+
+    try {
+      node->bytes = retention.size_of ? retention.size_of(*owner) : 0;
+    } catch (...) {
+      return false;
+    }
+
+    if (!room(node))
+      return false;
+
+    try {
+      node->retained = std::shared_ptr<Object>(std::move(owner));
+    } catch (const std::bad_alloc&) {
+      return false;
+    }
+
+    // We record the release even without a time to live since retain_for()
+    // might set one later.
+    node->released = std::chrono::steady_clock::now();
+
+    retention.push(node);
+    evict();
+    return true;
+  }
+
+  // Keep the value of this node alive while RetentionPolicy::CLOCK wants us
+  // to, starting with it being handed out.
+  void hold(Node* node, const std::shared_ptr<Object>& value) {
+    if (retention.policy != RetentionPolicy::CLOCK || retention.capacity == 0 || !node->linked || node->held != nullptr || dead(node))
+      return;
+
+    try {
+      node->bytes = retention.size_of ? retention.size_of(*value) : 0;
+    } catch (...) {
+      return;
+    }
+
+    if (!room(node))
+      return;
+
+    node->held = value;
+    node->released = std::chrono::steady_clock::now();
+
+    retention.push(node);
+    evict();
+  }
+
+  // Drop the nodes whose key expired in the next few buckets.
+  void sweep(std::size_t count) {
+    if constexpr (weak_keys) {
+      if (buckets.empty())
+        return;
+
+      for (count = std::min(count, buckets.size()); count != 0; count--) {
+        Node** link = &buckets[cursor];
+        while (Node* node = *link) {
+          if (dead(node))
+            drop(link);
+          else
+            link = &node->next;
+        }
+        cursor = (cursor + 1) & (buckets.size() - 1);
+      }
+    }
+  }
+
+  // Drop all nodes whose key expired.
+  void purge() {
+    if constexpr (weak_keys) {
+      for (Node*& head : buckets) {
+        Node** link = &head;
+        while (Node* node = *link) {
+          if (dead(node))
+            drop(link);
+          else
+            link = &node->next;
+        }
+      }
+    }
+  }
+
+  // Shrink the table so that it just fits the entries that are still alive.
+  void shrink() {
+    purge();
+
+    if (size == 0) {
+      std::vector<Node*>().swap(buckets);
+      bits = 0;
+      cursor = 0;
+      return;
+    }
+
+    unsigned int bits = 3;
+    while ((std::size_t(1) << bits) <= size)
+      bits++;
+    if (bits < this->bits)
+      rehash(bits);
+  }
+
+  // Return the memory pressure reported by a file in the format of
+  // /proc/pressure/memory; NONE if it cannot be read.
+  static MemoryPressure pressure(const char* path) {
+    std::FILE* file = std::fopen(path, "r");
+    if (file == nullptr)
+      return MemoryPressure::NONE;
+
+    double some = 0, full = 0;
+    char line[256];
+    while (std::fgets(line, sizeof(line), file) != nullptr) {
+      std::sscanf(line, "some avg10=%lf", &some);
+      std::sscanf(line, "full avg10=%lf", &full);
+    }
+    std::fclose(file);
+
+    if (full >= 10)
+      return MemoryPressure::CRITICAL;
+    if (some >= 10)
+      return MemoryPressure::MODERATE;
+    return MemoryPressure::NONE;
+  }
+
+  // Return the memory pressure file of the cgroup v2 that this process is
+  // in, as listed in the 0::<path> line of /proc/self/cgroup, or the system
+  // wide /proc/pressure/memory if there is no such file.
+  static std::string pressure_file() {
+    std::string path;
+    if (std::FILE* file = std::fopen("/proc/self/cgroup", "r")) {
+      char line[4096];
+      while (std::fgets(line, sizeof(line), file) != nullptr) {
+        if (std::strncmp(line, "0::/", 4) != 0)
+          continue;
+        std::string cgroup = line + 3;
+        while (!cgroup.empty() && (cgroup.back() == '\n' || cgroup.back() == '/'))
+          cgroup.pop_back();
+        path = "/sys/fs/cgroup" + cgroup + "/memory.pressure";
+        break;
+      }
+      std::fclose(file);
+    }
+
+    if (!path.empty()) {
+      if (std::FILE* file = std::fopen(path.c_str(), "r")) {
+        std::fclose(file);
+        return path;
+      }
+    }
+    return "/proc/pressure/memory";
+  }
+
+  void rehash(unsigned int bits) {
+    std::vector<Node*> previous(std::size_t(1) << bits, nullptr);
+    previous.swap(buckets);
+    counters.rehash();
+    if (previous.empty())
+      cursor = 0;
+    else
+      cursor = bits >= this->bits ? cursor << (bits - this->bits) : cursor >> (this->bits - bits);
+    this->bits = bits;
+
+    for (Node* node : previous) {
+      while (node != nullptr) {
+        Node* next = node->next;
+        Node*& head = buckets[bucket(node->hash)];
+        node->next = head;
+        head = node;
+        node = next;
+      }
+    }
+  }
+
+  // Drop a node whose construction failed.
+  void release(Node* node) {
+    {
+      Lock lock(*this);
+      if (node->linked)
+        unlink(node);
+      constructed.notify_all();
+    }
+
+    delete node;
+  }
+
+  // Drop a node whose Deleter has been invoked unless its object is kept
+  // alive by the factory; the caller destroys the object if it is not.
+  template <typename Owner>
+  void release(Node* node, Owner& owner) {
+    // The node belongs to us so we can read its key without the lock.
+    std::apply([&](const Key&... key) { observer.on_released(key...); }, node->key);
+
+    {
+      Lock lock(*this);
+      if (park(node, owner))
+        return;
+      if (node->linked) {
+        unlink(node);
+        counters.erasure();
+      }
+      constructed.notify_all();
+    }
+
+    delete node;
+  }
+
+  // Hand out the object of a node that this thread is creating; the lock
+  // must not be held.
+  template <typename Owner>
+  std::shared_ptr<Object> hand_out(Lock& lock, Node* node, Owner owner) {
+    // Should this throw, the Deleter releases the node.
+    Object* value = owner.get();
+    auto ret = std::shared_ptr<Object>(value, Deleter<Owner>(this, node, std::move(owner)));
+
+    lock.lock();
+    node->value = ret;
+    node->creator = std::thread::id();
+    hold(node, ret);
+    constructed.notify_all();
+
+    return ret;
+  }
+
+  // Hand out a released value that the factory kept alive again. This takes
+  // the node out of the list of retained values; it goes back in once the
+  // value is released again.
+  std::shared_ptr<Object> revive(Lock& lock, Node* node) {
+    retention.remove(node);
+    auto owner = std::move(node->retained);
+    node->creator = std::this_thread::get_id();
+
+    lock.unlock();
+
+    return hand_out(lock, node, std::move(owner));
+  }
+
+  // Return the value of a node that is not being constructed if it can be
+  // handed out with only a shared lock held.
+  optional_type hit(Node* node) const {
+    if constexpr (weak_values) {
+      // With RetentionPolicy::CLOCK, this is also how retained values are
+      // handed out again.
+      auto ret = node->value.lock();
+      if (ret != nullptr && retention.policy == RetentionPolicy::CLOCK && !node->referenced.load(std::memory_order_relaxed))
+        node->referenced.store(true, std::memory_order_relaxed);
+      return ret;
+    } else {
+      return node->value;
+    }
+  }
+
+  void count_hit(std::size_t hash, const Key&... key) {
+    LIBUNIQUEFACTORY_PROBE(hit, this, hash);
+    counters.hit();
+    observer.on_hit(key...);
+  }
+
+  void count_miss(std::size_t hash, const Key&... key) {
+    LIBUNIQUEFACTORY_PROBE(miss, this, hash);
+    counters.miss();
+    observer.on_miss(key...);
+  }
+
+  // Count a lookup of this key that returns this.
+  optional_type tally(optional_type ret, std::size_t hash, const Key&... key) {
+    if (ret)
+      count_hit(hash, key...);
+    else
+      count_miss(hash, key...);
+    return ret;
+  }
+
+  // Return the value of a node that is not being constructed.
+  optional_type load(Lock& lock, Node* node) {
+    if constexpr (weak_values) {
+      auto ret = node->value.lock();
+      if (ret == nullptr && node->retained != nullptr)
+        return revive(lock, node);
+      return ret;
+    } else {
+      return node->value;
+    }
+  }
+
  public:
-  UniqueFactory() = default;
-  UniqueFactory(const UniqueFactory&) = delete;
-  UniqueFactory(UniqueFactory&&) = delete;
+  explicit BasicUniqueFactory(Observer observer = Observer()) :
+    observer(std::move(observer)) {}
 
-  ~UniqueFactory() {
-#ifndef NDEBUG
-    if (cache.size() != 0) {
-      std::cerr << "A unique factory is leaking memory. " << cache.size() << " objects were created through a C++ unique factory but never released. These objects might be part of a legitimate cache that is (unfortunately) not explicitly released upon program termination as is common in garbage-collocting languages such as Python." << std::endl;
+  BasicUniqueFactory(const BasicUniqueFactory&) = delete;
+  BasicUniqueFactory(BasicUniqueFactory&&) = delete;
+
+  ~BasicUniqueFactory() {
+    if (registered)
+      libuniquefactory::registry().remove(this);
+
+    sweeper.reset();
+    monitor.reset();
+    expirer.reset();
+
+    if (!teardown)
+      return;
+
+    if constexpr (weak_values) {
+      {
+        // Release all pins and retained values; pinned values are then
+        // released like any other value but not retained anymore. Retained
+        // nodes belong to the factory and are freed once we unlock since
+        // their keys might be values of this factory. All other nodes
+        // belong to the Deleter of a value that is still alive; values that
+        // RetentionPolicy::CLOCK holds on to stay in the table until their
+        // Deleter runs.
+        Lock lock(*this);
+        retention.capacity = 0;
+        for (Node*& head : buckets) {
+          Node** link = &head;
+          while (Node* node = *link) {
+            if (node->held != nullptr)
+              forget(node);
+            if (node->pinned != nullptr || node->retained != nullptr)
+              drop(link);
+            else
+              link = &node->next;
+          }
+        }
+      }
+
+      if (reporter != nullptr) {
+        TeardownReport report;
+        report.leaked = size;
+        report.bytes = report.leaked * (sizeof(Node) + sizeof(ControlBlock<Deleter<std::unique_ptr<Object>>>) + sizeof(Object));
+        reporter(report);
+      }
+    } else {
+      for (Node* node : buckets)
+        while (node != nullptr)
+          delete std::exchange(node, node->next);
     }
-#endif
   }
   
-  UniqueFactory& operator=(const UniqueFactory&) = delete;
-  UniqueFactory& operator=(UniqueFactory&&) = delete;
+  BasicUniqueFactory& operator=(const BasicUniqueFactory&) = delete;
+  BasicUniqueFactory& operator=(BasicUniqueFactory&&) = delete;
 
-  std::shared_ptr<Value> get(const Key& key, std::function<Value*()> create) {
-    std::lock_guard<std::mutex> lock(mutex);
+  // A key reported by hot_keys() or rebuilt_keys(). The key has been seen
+  // count times but up to error of these might belong to other keys.
+  struct HotKey {
+    TrackedKey key;
+    std::uint64_t count;
+    std::uint64_t error;
+  };
+
+  // Track the capacity keys that are requested most often with get() and
+  // those whose values are created most often, i.e., that keep being
+  // released and created again and might be worth to pin() or to retain().
+  // Each get() then scans the tracked keys, so capacity should be small. A
+  // capacity of zero stops tracking.
+  void track_hot_keys(std::size_t capacity) {
+    // Destroyed without holding the lock since it holds copies of keys.
+    std::unique_ptr<HotKeys> previous;
+
+    Lock lock(*this);
+    previous = std::move(hot);
+    if (capacity != 0)
+      hot = std::make_unique<HotKeys>(capacity);
+  }
+
+  // Return the tracked keys that have been requested most often, the most
+  // frequent first; see track_hot_keys().
+  std::vector<HotKey> hot_keys() {
+    std::shared_lock<std::shared_mutex> lock(mutex, std::defer_lock);
+    acquire(lock);
+    if (hot == nullptr)
+      return {};
+    std::lock_guard<std::mutex> tracking(hot->mutex);
+    return hot->requests.template top<HotKey>(1);
+  }
+
+  // Return the tracked keys whose values have been created more than once,
+  // the most frequent first; see track_hot_keys().
+  std::vector<HotKey> rebuilt_keys() {
+    std::shared_lock<std::shared_mutex> lock(mutex, std::defer_lock);
+    acquire(lock);
+    if (hot == nullptr)
+      return {};
+    std::lock_guard<std::mutex> tracking(hot->mutex);
+    return hot->creations.template top<HotKey>(2);
+  }
+
+  // Add this factory to the registry of this process under this name, see
+  // libuniquefactory::factories(). It is removed again when the factory is
+  // destroyed. Calling this again changes the name.
+  void register_as(std::string name) {
+    libuniquefactory::registry().add(this, std::move(name), [](void* factory) {
+      return static_cast<BasicUniqueFactory*>(factory)->describe();
+    });
+    registered = true;
+  }
+
+  // Call reporter when this factory is destroyed to report the values that
+  // are still alive; by default, these are reported on standard error in
+  // debug builds. A nullptr disables the report.
+  void on_teardown(void (*reporter)(const TeardownReport&)) {
+    this->reporter = reporter;
+  }
+
+  // Do not free anything when this factory is destroyed, e.g., because it
+  // lives until the end of the program and freeing all its entries would
+  // only delay the exit. Threads started by the factory are still stopped.
+  void skip_teardown(bool skip = true) {
+    teardown = !skip;
+  }
+
+  // Return the hash of this key as used by the factory. Callers that need
+  // to look up the same key repeatedly can memoize this value and pass it to
+  // the overloads below that take a hash.
+  static std::size_t hash(const Key&... key) {
+    if constexpr (sizeof...(Key) == 1) {
+      return (Traits<Key>::hash(key), ...);
+    } else {
+      std::size_t hash = 0;
+      ((hash ^= Traits<Key>::hash(key) + 0x9e3779b9 + (hash << 6) + (hash >> 2)), ...);
+      return hash;
+    }
+  }
+
+  // Return the value for this key; if there is no such value, call create()
+  // to build it. The factory is not locked while create() runs, so create()
+  // may itself call into this factory; other threads asking for the same key
+  // wait for the construction to finish.
+  // With weak values, create() may return a pointer (that the factory takes
+  // ownership of,) a std::unique_ptr, a std::shared_ptr, or a T.
+  template <typename Create>
+  value_type get(const Key&... key, Create&& create) {
+    return get(key..., hash(key...), std::forward<Create>(create));
+  }
+
+  // Return the value for this key like get() above; hash must be the value
+  // of hash() for this key, typically memoized by the caller.
+  template <typename Create>
+  value_type get(const Key&... key, std::size_t hash, Create&& create) {
+    // The keys that the tracker of hot keys lets go of; they are destroyed
+    // after we unlock since they might hold on to values of this factory.
+    std::optional<TrackedKey> requested, created;
+
+    {
+      std::shared_lock<std::shared_mutex> lock(mutex, std::defer_lock);
+      acquire(lock);
+      record(hash);
+
+      // Under contention, some requests go uncounted rather than have all
+      // threads line up on the tracker.
+      if (hot != nullptr) {
+        std::unique_lock<std::mutex> tracking(hot->mutex, std::try_to_lock);
+        if (tracking)
+          requested = hot->requests.add(hash, key...);
+      }
+
+      Node* node = search(hash, key...);
+      if (node != nullptr && node->creator == std::thread::id()) {
+        auto ret = hit(node);
+        if constexpr (weak_values) {
+          if (ret != nullptr) {
+            count_hit(hash, key...);
+            return ret;
+          }
+        } else {
+          count_hit(hash, key...);
+          return std::move(*ret);
+        }
+      }
+    }
+
+    Lock lock(*this);
+    expire();
+
+    Node* node = lookup(hash, key...);
+    while (node != nullptr && node->creator != std::thread::id()) {
+      if (node->creator == std::this_thread::get_id())
+        throw std::logic_error("unique factory asked to create a key recursively while creating that same key");
+      lock.wait();
+      node = lookup(hash, key...);
+    }
+
+    if (node != nullptr) {
+      if constexpr (weak_values) {
+        auto ret = node->value.lock();
+        if (ret) {
+          count_hit(hash, key...);
+          return ret;
+        }
+        if (node->retained != nullptr) {
+          count_hit(hash, key...);
+          return revive(lock, node);
+        }
+        // The value expired but its Deleter has not run yet; the Deleter is
+        // going to free this node once it gets to run.
+        unlink(node);
+        counters.recreation();
+      } else {
+        count_hit(hash, key...);
+        return *node->value;
+      }
+    }
+
+    count_miss(hash, key...);
+    if (hot != nullptr) {
+      std::lock_guard<std::mutex> tracking(hot->mutex);
+      created = hot->creations.add(hash, key...);
+    }
+    node = insert(hash, key...);
+    node->creator = std::this_thread::get_id();
 
-    std::shared_ptr<Value> ret;
+    lock.unlock();
 
-    auto cached = cache.find(key);
-    if (cached != cache.end()) {
-      ret = cached->second.lock();
+    LIBUNIQUEFACTORY_PROBE(create__start, this, hash);
+
+    if constexpr (weak_values) {
+      const auto start = std::chrono::steady_clock::now();
+
+      auto owner = [&]() {
+        try {
+          return own(create());
+        } catch (...) {
+          release(node);
+          throw;
+        }
+      }();
+
+      const auto duration = std::chrono::steady_clock::now() - start;
+      LIBUNIQUEFACTORY_PROBE(create__end, this, hash);
+      counters.created(duration);
+
+      // Nobody else looks at this node until hand_out() publishes it.
+      node->cost = std::chrono::duration<double>(duration).count();
+
+      auto ret = hand_out(lock, node, std::move(owner));
+      lock.unlock();
+
+      observer.on_created(ret, key...);
+      return ret;
     } else {
-      ret = std::shared_ptr<Value>(create(), Deleter(this, key));
-      cache[key] = ret;
+      const auto start = Counters::timed ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+
+      Value value = [&]() {
+        try {
+          return Value(create());
+        } catch (...) {
+          release(node);
+          throw;
+        }
+      }();
+
+      LIBUNIQUEFACTORY_PROBE(create__end, this, hash);
+
+      if constexpr (Counters::timed)
+        counters.created(std::chrono::steady_clock::now() - start);
+
+      // Moving the value into the node might throw; then the node must be
+      // dropped just like when create() throws.
+      try {
+        lock.lock();
+        node->value.emplace(std::move(value));
+      } catch (...) {
+        lock.unlock();
+        release(node);
+        throw;
+      }
+      node->creator = std::thread::id();
+      constructed.notify_all();
+
+      // The value is published; should copying it throw, the next get()
+      // finds it.
+      Value ret = *node->value;
+      lock.unlock();
+
+      observer.on_created(ret, key...);
+      return ret;
+    }
+  }
+
+  // Keep up to capacity values alive after their last reference outside the
+  // factory went away so that they need not be recreated when they are
+  // requested again soon; the policy decides which values are dropped
+  // first. Only factories with weak values release values.
+  void retain(std::size_t capacity, RetentionPolicy policy = RetentionPolicy::LRU) {
+    static_assert(weak_values, "only factories with weak values can retain released values");
+
+    Lock lock(*this);
+    // RetentionPolicy::CLOCK holds on to values that are still in use while
+    // the other policies hold on to released values, so the values retained
+    // under one cannot be carried over to the other.
+    if ((policy == RetentionPolicy::CLOCK) != (retention.policy == RetentionPolicy::CLOCK))
+      while (retention.oldest != nullptr)
+        forget(retention.oldest);
+    retention.configure(policy);
+    retention.capacity = capacity;
+    if (retention.admission == AdmissionPolicy::TINY_LFU)
+      retention.sketch.resize(capacity);
+    evict();
+  }
+
+  // Decide whether to keep a released value alive when the retained values
+  // are at capacity, see AdmissionPolicy.
+  void admit(AdmissionPolicy admission) {
+    static_assert(weak_values, "only factories with weak values can retain released values");
+
+    Lock lock(*this);
+    retention.admission = admission;
+    if (admission == AdmissionPolicy::TINY_LFU)
+      retention.sketch.resize(retention.capacity);
+  }
+
+  // Keep values alive for ttl after their last reference outside the
+  // factory went away. Together with retain(), values are dropped when
+  // either limit is reached; otherwise the number of retained values is not
+  // bounded. An expired value is never handed out again. It is dropped when
+  // the factory creates or revives a value or when a value is released and
+  // at the latest by a thread that wakes up every ttl, so values are kept
+  // alive for less than twice the ttl; their keys and values might then be
+  // destroyed on that thread. With RetentionPolicy::CLOCK, values are
+  // retained from the moment they are handed out, so the time to live
+  // counts from then. A ttl of zero disables this and stops the thread.
+  // This must not be called concurrently with itself.
+  void retain_for(std::chrono::steady_clock::duration ttl) {
+    static_assert(weak_values, "only factories with weak values can retain released values");
+
+    // The thread takes the lock, so we stop it before we take the lock.
+    expirer.reset();
+
+    {
+      Lock lock(*this);
+      if (ttl != std::chrono::steady_clock::duration::zero() && retention.capacity == 0)
+        retention.capacity = std::numeric_limits<std::size_t>::max();
+      if (ttl == std::chrono::steady_clock::duration::zero() && retention.capacity == std::numeric_limits<std::size_t>::max() && !retention.size_of)
+        retention.capacity = 0;
+      retention.ttl = ttl;
+      evict();
+    }
+
+    if (ttl == std::chrono::steady_clock::duration::zero())
+      return;
+
+    expirer = std::make_unique<Periodic>(ttl, [this]() {
+      Lock lock(*this);
+      expire();
+    });
+  }
+
+  // Keep released values alive while their total size is at most budget
+  // bytes as measured by size_of(const T&); the retention policy decides
+  // which values are dropped first. Together with retain(), values are
+  // dropped when either limit is reached. size_of is called with the factory
+  // locked when a value is released, so it must not call into the factory.
+  template <typename SizeOf>
+  void retain_bytes(std::size_t budget, SizeOf&& size_of) {
+    static_assert(weak_values, "only factories with weak values can retain released values");
+
+    std::function<std::size_t(const Object&)> measure(std::forward<SizeOf>(size_of));
+
+    Lock lock(*this);
+
+    // Measure the values that are already retained again so that the total
+    // agrees with the new size_of; if that throws, nothing changes.
+    std::vector<std::size_t> bytes;
+    bytes.reserve(retention.count);
+    for (Node* node = retention.oldest; node != nullptr; node = node->newer)
+      bytes.push_back(measure(*node->retained));
+
+    if (retention.capacity == 0)
+      retention.capacity = std::numeric_limits<std::size_t>::max();
+    retention.budget = budget;
+    retention.size_of = std::move(measure);
+    retention.bytes = 0;
+    auto size = bytes.begin();
+    for (Node* node = retention.oldest; node != nullptr; node = node->newer) {
+      node->bytes = *size++;
+      retention.bytes += node->bytes;
     }
+    if (retention.policy == RetentionPolicy::GREEDY_DUAL) {
+      retention.heap.clear();
+      for (Node* node = retention.oldest; node != nullptr; node = node->newer)
+        retention.enqueue(node);
+    }
+
+    evict();
+  }
+
+  // Return the value for this key like get() and keep it alive until
+  // unpin() is called, regardless of any retention policy. While a value is
+  // pinned, pinned() returns it without touching its reference count.
+  // If a component of the key expires, the entry can never be looked up
+  // again, so the factory then releases the pin itself the next time it
+  // comes across the entry.
+  template <typename Create>
+  value_type pin(const Key&... key, Create&& create) {
+    static_assert(weak_values, "only factories with weak values can pin values");
 
+    const std::size_t hash = this->hash(key...);
+    auto ret = get(key..., hash, std::forward<Create>(create));
+
+    Lock lock(*this);
+    // The node might be gone if a component of the key expired meanwhile.
+    Node* node = lookup(hash, key...);
+    if (node != nullptr && node->creator == std::thread::id() && node->pinned == nullptr && node->value.lock() == ret)
+      node->pinned = ret;
     return ret;
   }
+
+  // Stop keeping the value for this key alive, see pin(). Returns whether
+  // the value was pinned.
+  bool unpin(const Key&... key) {
+    static_assert(weak_values, "only factories with weak values can pin values");
+
+    // Released after the lock since this might run the Deleter.
+    std::shared_ptr<Object> pinned;
+
+    Lock lock(*this);
+    Node* node = lookup(hash(key...), key...);
+    if (node == nullptr)
+      return false;
+    pinned = std::move(node->pinned);
+    return pinned != nullptr;
+  }
+
+  // Return the pinned value for this key or nullptr if it is not pinned.
+  // The pointer stays valid until unpin() or, if a component of the key can
+  // expire, until it expires, see pin(). Callers that hold on to the
+  // pointer and do not consult the factory again must therefore keep the
+  // key alive.
+  Object* pinned(const Key&... key) {
+    static_assert(weak_values, "only factories with weak values can pin values");
+
+    std::shared_lock<std::shared_mutex> lock(mutex, std::defer_lock);
+    acquire(lock);
+    Node* node = search(hash(key...), key...);
+    return node == nullptr ? nullptr : node->pinned.get();
+  }
+
+  // Start a thread that wakes up every interval to drop entries whose weak
+  // key expired and released values that outlived retain_for(); each round
+  // looks at a bounded number of buckets so lookups are not blocked for
+  // long. Without it, entries whose key expired are only dropped when they
+  // come up in a lookup or an insertion. An interval of zero stops the thread. Keys and
+  // values might then be destroyed on that thread. This must not be called
+  // concurrently with itself.
+  void sweep_every(std::chrono::steady_clock::duration interval) {
+    sweeper.reset();
+
+    if (interval == std::chrono::steady_clock::duration::zero())
+      return;
+
+    sweeper = std::make_unique<Periodic>(interval, [this]() {
+      Lock lock(*this);
+      expire();
+      sweep(256);
+    });
+  }
+
+  // Give memory back: drop released values that the factory keeps alive
+  // (pinned values are never released) and, if the pressure is critical,
+  // drop entries whose key expired and shrink the table.
+  void on_memory_pressure(MemoryPressure level) {
+    if (level == MemoryPressure::NONE)
+      return;
+
+    Lock lock(*this);
+
+    if constexpr (weak_values) {
+      const std::size_t keep = level == MemoryPressure::MODERATE ? retention.count / 2 : 0;
+      while (retention.count > keep)
+        evict(retention.victim());
+      if (retention.count == 0)
+        retention.heap.shrink_to_fit();
+    }
+
+    if (level == MemoryPressure::CRITICAL)
+      shrink();
+  }
+
+  // Start a thread that reads the pressure stall information of memory
+  // every interval and calls on_memory_pressure() accordingly: critical if
+  // all tasks have been stalled on memory at least 10% of the time over the
+  // last ten seconds, moderate if some tasks have been. The information is
+  // read from path which defaults to the file of the cgroup v2 that this
+  // process is in, see /proc/self/cgroup, or, failing that, the system wide
+  // /proc/pressure/memory. An interval of zero stops the thread. This must
+  // not be called concurrently with itself.
+  void monitor_memory_pressure(std::chrono::steady_clock::duration interval, std::string path = "") {
+    monitor.reset();
+
+    if (interval == std::chrono::steady_clock::duration::zero())
+      return;
+
+    if (path.empty())
+      path = pressure_file();
+
+    monitor = std::make_unique<Periodic>(interval, [this, path]() {
+      on_memory_pressure(pressure(path.c_str()));
+    });
+  }
+
+  // Call f(key..., value) for all values that have been handed out and are
+  // still alive (for weak values) or that have been created (for memo
+  // tables.) The table is traversed a slice of buckets at a time under a
+  // shared lock and f is called without holding any lock, so f may call
+  // into the factory. Entries that are added or removed during the
+  // traversal might or might not be visited; all others are visited
+  // exactly once.
+  template <typename F>
+  void for_each_live(F&& f) {
+    constexpr unsigned int width = sizeof(std::size_t) * 8;
+    constexpr std::size_t slice = 64;
+
+    // The traversal goes through the space of mixed hashes which is
+    // independent of the size of the table, so it can continue correctly
+    // if the table is resized between two slices.
+    std::size_t from = 0;
+    bool done = false;
+
+    std::vector<std::pair<std::tuple<Key...>, value_type>> batch;
+    while (!done) {
+      batch.clear();
+
+      {
+        std::shared_lock<std::shared_mutex> lock(mutex, std::defer_lock);
+        acquire(lock);
+
+        if (buckets.empty())
+          return;
+
+        const std::size_t first = from >> (width - bits);
+        const std::size_t last = std::min(buckets.size(), first + slice);
+        for (std::size_t i = first; i != last; i++) {
+          for (const Node* node = buckets[i]; node != nullptr; node = node->next) {
+            if (mix(node->hash) < from || node->creator != std::thread::id() || dead(node))
+              continue;
+            if constexpr (weak_values) {
+              if (auto value = node->value.lock())
+                batch.emplace_back(node->key, std::move(value));
+            } else {
+              batch.emplace_back(node->key, *node->value);
+            }
+          }
+        }
+
+        if (last == buckets.size())
+          done = true;
+        else
+          from = last << (width - bits);
+      }
+
+      for (const auto& [key, value] : batch)
+        std::apply([&](const Key&... key) { f(key..., value); }, key);
+    }
+  }
+
+  // Return all values that have been handed out and are still alive (for
+  // weak values) or that have been created (for memo tables), see
+  // for_each_live().
+  std::vector<value_type> snapshot() {
+    std::vector<value_type> ret;
+    for_each_live([&](const Key&..., const value_type& value) { ret.push_back(value); });
+    return ret;
+  }
+
+  // Return what the registry reports about this factory.
+  libuniquefactory::FactoryInfo describe() {
+    libuniquefactory::FactoryInfo ret;
+    ret.bytes = memory_usage().total();
+#ifdef UNIQUE_FACTORY_STATISTICS
+    const Statistics statistics = this->statistics();
+    ret.size = std::size_t(statistics.size);
+    ret.statistics = true;
+    ret.hits = statistics.hits;
+    ret.misses = statistics.misses;
+#else
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    ret.size = size;
+#endif
+    return ret;
+  }
+
+  // Return how much memory this factory uses. The table is traversed
+  // completely, so this is not meant to be called often.
+  MemoryUsage memory_usage() {
+    return memory_usage([](const Key&...) { return std::size_t(0); });
+  }
+
+  // Return how much memory this factory uses like memory_usage() above;
+  // key_size(key...) returns how many bytes a key allocated on the heap.
+  template <typename KeySize>
+  MemoryUsage memory_usage(KeySize&& key_size) {
+    std::shared_lock<std::shared_mutex> lock(mutex, std::defer_lock);
+    acquire(lock);
+
+    MemoryUsage ret;
+    ret.buckets = buckets.capacity() * sizeof(Node*);
+    ret.nodes = size * sizeof(Node);
+    ret.bookkeeping = sizeof(*this);
+
+    for (const Node* head : buckets) {
+      for (const Node* node = head; node != nullptr; node = node->next) {
+        ret.keys += std::apply(key_size, node->key);
+        if constexpr (weak_values) {
+          if (node->retained != nullptr)
+            ret.control_blocks += sizeof(ControlBlock<std::default_delete<Object>>);
+          else if (!node->value.expired())
+            ret.control_blocks += sizeof(ControlBlock<Deleter<std::unique_ptr<Object>>>);
+        }
+      }
+    }
+
+    if constexpr (weak_values) {
+      ret.retained = retention.size_of ? retention.bytes : retention.count * sizeof(Object);
+      ret.bookkeeping += retention.heap.capacity() * sizeof(Node*) + retention.sketch.words.capacity() * sizeof(std::uint64_t);
+    }
+
+    return ret;
+  }
+
+#ifdef UNIQUE_FACTORY_STATISTICS
+  // Return what this factory has been doing so far.
+  Statistics statistics() {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+
+    Statistics ret;
+    for (const auto& stripe : counters.stripe) {
+      ret.hits += stripe.hits.load(std::memory_order_relaxed);
+      ret.misses += stripe.misses.load(std::memory_order_relaxed);
+      ret.contentions += stripe.contentions.load(std::memory_order_relaxed);
+      ret.wait += std::chrono::nanoseconds(stripe.wait.load(std::memory_order_relaxed));
+    }
+    ret.recreations = counters.recreations;
+    ret.erasures = counters.erasures;
+    ret.size = size;
+    ret.peak = counters.peak;
+    ret.rehashes = counters.rehashes;
+    ret.longest_wait = std::chrono::nanoseconds(counters.longest_wait.load(std::memory_order_relaxed));
+    for (std::size_t bucket = 0; bucket < Histogram::size; bucket++)
+      ret.creation.counts[bucket] = counters.creation[bucket].load(std::memory_order_relaxed);
+    return ret;
+  }
+#endif
+
+  // Create the values for all these keys with create(key...), distributing
+  // the work over threads provided by executor, and return them in the
+  // order of the keys, i.e., with weak values the returned vector keeps the
+  // values alive.
+  // The executor is called with a std::function<void()> and must run it,
+  // e.g., by submitting it to a thread pool. If there are several key
+  // components, the keys must be tuples of them.
+  template <typename Keys, typename Create, typename Executor>
+  std::vector<value_type> prewarm(const Keys& keys, const Create& create, Executor&& executor) {
+    const std::size_t count = std::size(keys);
+
+    std::vector<std::optional<value_type>> values(count);
+
+    std::mutex mutex;
+    std::condition_variable finished;
+    std::exception_ptr error;
+    std::atomic<std::size_t> next{0};
+
+    std::size_t tasks = std::min<std::size_t>(count, std::max(1u, std::thread::hardware_concurrency()));
+    std::size_t pending = tasks;
+
+    // Each task takes keys from the shared list until there are none left,
+    // so a few slow constructions do not keep the other threads idle.
+    std::function<void()> task = [&]() {
+      std::exception_ptr failure;
+      try {
+        auto key = std::begin(keys);
+        std::size_t position = 0;
+        for (std::size_t i = next++; i < count; i = next++) {
+          std::advance(key, i - position);
+          position = i;
+
+          const auto& components = *key;
+          if constexpr (sizeof...(Key) == 1) {
+            values[i].emplace(get(components, [&]() { return create(components); }));
+          } else {
+            values[i].emplace(std::apply([&](const auto&... key) { return get(key..., [&]() { return create(key...); }); }, components));
+          }
+        }
+      } catch (...) {
+        failure = std::current_exception();
+        next = count;
+      }
+
+      // We notify while holding the lock so that prewarm() cannot return
+      // (and destroy what this task refers to) before we are done.
+      std::lock_guard<std::mutex> lock(mutex);
+      if (failure && !error)
+        error = failure;
+      if (--pending == 0)
+        finished.notify_all();
+    };
+
+    std::size_t submitted = 0;
+    try {
+      for (; submitted < tasks; submitted++)
+        executor(task);
+    } catch (...) {
+      // The tasks that have been submitted refer to our locals, so we must
+      // not leave before they are done; we tell them to stop early.
+      next = count;
+      std::lock_guard<std::mutex> lock(mutex);
+      pending -= tasks - submitted;
+      error = std::current_exception();
+    }
+
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      finished.wait(lock, [&]() { return pending == 0; });
+    }
+
+    if (error)
+      std::rethrow_exception(error);
+
+    std::vector<value_type> ret;
+    ret.reserve(count);
+    for (auto& value : values)
+      ret.push_back(std::move(*value));
+    return ret;
+  }
+
+  // Return the value for this key if there is one. If the value is being
+  // created by another thread, wait for it.
+  optional_type find(const Key&... key) {
+    return find(key..., hash(key...));
+  }
+
+  // Return the value for this key like find() above; hash must be the value
+  // of hash() for this key.
+  optional_type find(const Key&... key, std::size_t hash) {
+    {
+      std::shared_lock<std::shared_mutex> lock(mutex, std::defer_lock);
+      acquire(lock);
+      record(hash);
+
+      Node* node = search(hash, key...);
+      if (node == nullptr)
+        return tally(optional_type(), hash, key...);
+      if (node->creator == std::thread::id()) {
+        auto ret = hit(node);
+        if (ret)
+          return tally(std::move(ret), hash, key...);
+      }
+    }
+
+    Lock lock(*this);
+    expire();
+
+    while (true) {
+      Node* node = lookup(hash, key...);
+      if (node == nullptr)
+        return tally(optional_type(), hash, key...);
+      if (node->creator == std::thread::id())
+        return tally(load(lock, node), hash, key...);
+      if (node->creator == std::this_thread::get_id())
+        return tally(optional_type(), hash, key...);
+      lock.wait();
+    }
+  }
+
+  // Return the value for this key if there is one and it is not being
+  // created anymore; never waits for a construction.
+  optional_type try_get(const Key&... key) {
+    return try_get(key..., hash(key...));
+  }
+
+  // Return the value for this key like try_get() above; hash must be the
+  // value of hash() for this key.
+  optional_type try_get(const Key&... key, std::size_t hash) {
+    {
+      std::shared_lock<std::shared_mutex> lock(mutex, std::defer_lock);
+      acquire(lock);
+      record(hash);
+
+      Node* node = search(hash, key...);
+      if (node == nullptr || node->creator != std::thread::id())
+        return tally(optional_type(), hash, key...);
+      auto ret = hit(node);
+      if (ret)
+        return tally(std::move(ret), hash, key...);
+    }
+
+    Lock lock(*this);
+    expire();
+
+    Node* node = lookup(hash, key...);
+    if (node == nullptr || node->creator != std::thread::id())
+      return tally(optional_type(), hash, key...);
+    return tally(load(lock, node), hash, key...);
+  }
 };
 
+// A factory that does not report what it does and that hashes and compares
+// its keys with KeyComponent, see BasicUniqueFactory.
+template <typename Value, typename... Key>
+using UniqueFactory = BasicUniqueFactory<NoObserver, KeyComponent, Value, Key...>;
+
 }
 
 }
 
+#undef LIBUNIQUEFACTORY_PROBE
+
 #endif